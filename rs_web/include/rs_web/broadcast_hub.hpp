@@ -0,0 +1,143 @@
+#ifndef BROADCAST_HUB_HPP
+#define	BROADCAST_HUB_HPP
+
+#include "server_http.hpp"
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+namespace SimpleWeb {
+    ///Publishes messages to the WebSocket connections subscribed to it. A message is framed once, and the same immutable
+    ///frame is queued to every subscriber without copying it; subscribers with permessage-deflate share one compressed frame.
+    ///Subscribers that cannot keep up, that is whose output is above config.output_high_watermark, are handled by their policy.
+    template<class socket_type>
+    class BroadcastHub {
+    public:
+        typedef typename ServerBase<socket_type>::WebSocket WebSocket;
+
+        enum Policy {
+            ///Every message is sent, for streams where no message may be lost, such as events
+            keep_all,
+            ///Messages are dropped while the subscriber is slow
+            drop,
+            ///While the subscriber is slow, only the latest message is kept and sent once it has caught up,
+            ///for messages that replace the previous ones, such as scene updates
+            coalesce
+        };
+
+        BroadcastHub(): subscribers(std::make_shared<const std::vector<std::shared_ptr<Subscriber> > >()), dropped_messages(0) {}
+
+        BroadcastHub(const BroadcastHub&)=delete;
+        BroadcastHub &operator=(const BroadcastHub&)=delete;
+
+        void subscribe(const std::shared_ptr<WebSocket> &websocket, Policy policy=keep_all) {
+            auto subscriber=std::make_shared<Subscriber>(websocket, policy);
+            std::lock_guard<std::mutex> lock(mutex);
+            auto next=std::make_shared<std::vector<std::shared_ptr<Subscriber> > >(*subscribers);
+            next->emplace_back(std::move(subscriber));
+            subscribers=std::move(next);
+        }
+
+        void unsubscribe(const std::shared_ptr<WebSocket> &websocket) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto next=std::make_shared<std::vector<std::shared_ptr<Subscriber> > >(*subscribers);
+            next->erase(std::remove_if(next->begin(), next->end(), [&websocket](const std::shared_ptr<Subscriber> &subscriber) {
+                return subscriber->websocket==websocket;
+            }), next->end());
+            subscribers=std::move(next);
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return subscribers->size();
+        }
+
+        ///Messages dropped or replaced by a later message because their subscriber was slow
+        size_t dropped() const {
+            return dropped_messages;
+        }
+
+        ///Sends payload to all subscribers. Can be called from any thread.
+        void publish(boost::string_ref payload, unsigned char opcode=WebSocketProtocol::text) {
+            std::shared_ptr<const std::vector<std::shared_ptr<Subscriber> > > subscribers;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                subscribers=this->subscribers;
+            }
+            std::shared_ptr<const std::string> frames[2];
+            for(auto &subscriber: *subscribers) {
+                auto &frame=frames[subscriber->websocket->deflate()?1:0];
+                if(!frame)
+                    frame=std::make_shared<std::string>(WebSocketProtocol::message_frame(opcode, payload, subscriber->websocket->deflate()));
+                send(subscriber, frame);
+            }
+        }
+
+    private:
+        class Subscriber {
+        public:
+            Subscriber(const std::shared_ptr<WebSocket> &websocket, Policy policy): websocket(websocket), policy(policy), waiting(false) {}
+            std::shared_ptr<WebSocket> websocket;
+            Policy policy;
+
+            std::mutex mutex;
+            ///Set while waiting for the subscriber to become writable
+            bool waiting;
+            ///The frame sent when the subscriber has caught up, if its policy is coalesce
+            std::shared_ptr<const std::string> pending;
+        };
+
+        std::mutex mutex;
+        ///Replaced on every change, so that publish() does not hold the mutex while sending
+        std::shared_ptr<const std::vector<std::shared_ptr<Subscriber> > > subscribers;
+        std::atomic<size_t> dropped_messages;
+
+        void send(const std::shared_ptr<Subscriber> &subscriber, const std::shared_ptr<const std::string> &frame) {
+            if(subscriber->policy==keep_all) {
+                subscriber->websocket->send_frame(frame);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(subscriber->mutex);
+                if(!subscriber->waiting) {
+                    if(subscriber->websocket->writable()) {
+                        subscriber->websocket->send_frame(frame);
+                        return;
+                    }
+                    subscriber->waiting=true;
+                    keep(*subscriber, frame);
+                }
+                else {
+                    keep(*subscriber, frame);
+                    return;
+                }
+            }
+            //Called right away if the subscriber has caught up in the meantime
+            subscriber->websocket->on_writable([subscriber] {
+                std::shared_ptr<const std::string> pending;
+                {
+                    std::lock_guard<std::mutex> lock(subscriber->mutex);
+                    subscriber->waiting=false;
+                    pending.swap(subscriber->pending);
+                }
+                if(pending)
+                    subscriber->websocket->send_frame(pending);
+            });
+        }
+
+        ///Keeps frame as the pending frame of a slow subscriber, or drops it
+        void keep(Subscriber &subscriber, const std::shared_ptr<const std::string> &frame) {
+            if(subscriber.policy==coalesce) {
+                if(subscriber.pending)
+                    dropped_messages++;
+                subscriber.pending=frame;
+            }
+            else
+                dropped_messages++;
+        }
+    };
+}
+#endif	/* BROADCAST_HUB_HPP */
@@ -33,15 +33,27 @@ SOFTWARE.
 
 #include <unordered_map>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <sstream>
 #include <random>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <functional>
 #include <type_traits>
+#include <cerrno>
+#include <sys/socket.h>
 
 namespace SimpleWeb {
     template <class socket_type>
     class ClientBase {
     public:
-        virtual ~ClientBase() {}
+        virtual ~ClientBase() {
+            close();
+        }
 
         class Response {
             friend class ClientBase<socket_type>;
@@ -84,128 +96,243 @@ namespace SimpleWeb {
             size_t timeout=0;
             /// Set proxy server (server:port)
             std::string proxy_server;
+            /// Maximum number of connections to the server. Further requests wait for a connection to become free.
+            /// Default value: 0 (no limit).
+            size_t max_connections=0;
+            /// Close connections that have been idle for this many seconds. Default value: 60, 0 keeps them open.
+            size_t idle_timeout=60;
+            /// Reuse the resolved addresses of the server for this many seconds. Default value: 300.
+            size_t dns_cache_time=300;
+            /// Maximum size of the content of a response in bytes, larger responses fail with boost::asio::error::message_size.
+            /// Default value: 0 (no limit).
+            size_t max_content_size=0;
         };
         
         /// Set before calling request
         Config config;
+
+        /// The io_service the requests run on. Replace it before the first request to run the requests on an io_service of your own,
+        /// run by your threads. The io_service of the client is run by the synchronous request() while it waits, and otherwise
+        /// has to be run by the caller of async_request(). Idle connections keep io_service busy until config.idle_timeout
+        /// or close(). Requests must have completed before the client is destroyed.
+        std::shared_ptr<boost::asio::io_service> io_service;
+
+        typedef std::function<void(const std::shared_ptr<Response>&, const boost::system::error_code&)> RequestCallback;
+
+        /// Called with the pieces of the content of a response as they are received, which are then not stored in
+        /// response->content. The status and header of response have been read already. data is valid during the call only.
+        typedef std::function<void(const std::shared_ptr<Response> &response, const char *data, size_t size)> ContentHandler;
+
+        /// A request of a batch. If the server closes the connection before it has answered all requests of a batch, the
+        /// unanswered ones are only sent again on a new connection if the server announced it with "Connection: close"
+        /// on the last response, so that it has not read them, or if they are all idempotent (GET, HEAD, PUT, DELETE or
+        /// OPTIONS), or if none of them had been written. Otherwise the server may have processed some of them, and the
+        /// batch fails with the error instead of sending them twice.
+        class BatchRequest {
+        public:
+            std::string request_type, path, content;
+            std::map<std::string, std::string> header;
+            /// Receives the content of the response if set
+            ContentHandler content_handler;
+        };
+
+        typedef std::function<void(const std::vector<std::shared_ptr<Response> >&, const boost::system::error_code&)> BatchCallback;
+
+        /// Sends a request without waiting for the response, and calls callback with the response once it has been read,
+        /// or with the error that ended the request. Any number of requests can be in flight at once, each on a connection
+        /// of its own, up to config.max_connections. Connections the server keeps alive are reused by later requests.
+        /// If the server has closed a reused connection, the request is sent again on a new one, unless it may have reached
+        /// the server and is not idempotent. callback is called on a thread running io_service.
+        void async_request(const std::string& request_type, const std::string& path, boost::string_ref content,
+                const std::map<std::string, std::string>& header, const RequestCallback& callback) {
+            async_request(request_type, path, content, header, nullptr, callback);
+        }
+
+        /// As async_request() above, but passes the content of the response to content_handler as it is received, so that
+        /// large responses are processed with constant memory. callback is called once the content has been passed.
+        void async_request(const std::string& request_type, const std::string& path, boost::string_ref content,
+                const std::map<std::string, std::string>& header, const ContentHandler& content_handler, const RequestCallback& callback) {
+            std::vector<std::string> requests;
+            requests.emplace_back(make_request(request_type, path, content, header));
+            auto session=std::make_shared<Session>(std::move(requests), [callback](const std::vector<std::shared_ptr<Response> > &responses,
+                                                                                   const boost::system::error_code &ec) {
+                callback(responses.empty()?std::shared_ptr<Response>(new Response()):responses.front(), ec);
+            });
+            session->content_handlers.emplace_back(content_handler);
+            assign(session);
+        }
+
+        /// As async_request() with a callback, but returns the response through a future, which throws
+        /// boost::system::system_error if the request fails.
+        std::future<std::shared_ptr<Response> > async_request(const std::string& request_type, const std::string& path="/", boost::string_ref content="",
+                const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
+            auto promise=std::make_shared<std::promise<std::shared_ptr<Response> > >();
+            auto future=promise->get_future();
+            async_request(request_type, path, content, header, [promise](const std::shared_ptr<Response> &response, const boost::system::error_code &ec) {
+                if(ec)
+                    promise->set_exception(std::make_exception_ptr(boost::system::system_error(ec)));
+                else
+                    promise->set_value(response);
+            });
+            return future;
+        }
         
+        /// Sends a request and waits for the response. Throws boost::system::system_error if the request fails.
+        /// With an io_service of your own, its threads read the response, so do not call request() from one of them.
         std::shared_ptr<Response> request(const std::string& request_type, const std::string& path="/", boost::string_ref content="",
                 const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
-            auto corrected_path=path;
-            if(corrected_path=="")
-                corrected_path="/";
-            if(!config.proxy_server.empty() && std::is_same<socket_type, boost::asio::ip::tcp::socket>::value)
-                corrected_path="http://"+host+':'+std::to_string(port)+corrected_path;
-            
-            boost::asio::streambuf write_buffer;
-            std::ostream write_stream(&write_buffer);
-            write_stream << request_type << " " << corrected_path << " HTTP/1.1\r\n";
-            write_stream << "Host: " << host << "\r\n";
-            for(auto& h: header) {
-                write_stream << h.first << ": " << h.second << "\r\n";
-            }
-            if(content.size()>0)
-                write_stream << "Content-Length: " << content.size() << "\r\n";
-            write_stream << "\r\n";
-            
-            connect();
-            
-            auto timer=get_timeout_timer();
-            boost::asio::async_write(*socket, write_buffer,
-                                     [this, &content, timer](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
-                if(timer)
-                    timer->cancel();
-                if(!ec) {
-                    if(!content.empty()) {
-                        auto timer=get_timeout_timer();
-                        boost::asio::async_write(*socket, boost::asio::buffer(content.data(), content.size()),
-                                             [this, timer](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
-                            if(timer)
-                                timer->cancel();
-                            if(ec) {
-                                std::lock_guard<std::mutex> lock(socket_mutex);
-                                socket=nullptr;
-                                throw boost::system::system_error(ec);
-                            }
-                        });
-                    }
-                }
-                else {
-                    std::lock_guard<std::mutex> lock(socket_mutex);
-                    socket=nullptr;
-                    throw boost::system::system_error(ec);
-                }
-            });
-            io_service.reset();
-            io_service.run();
-            
-            return request_read();
+            auto future=async_request(request_type, path, content, header);
+            return wait(future);
         }
         
         std::shared_ptr<Response> request(const std::string& request_type, const std::string& path, std::iostream& content,
                 const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
-            auto corrected_path=path;
-            if(corrected_path=="")
-                corrected_path="/";
-            if(!config.proxy_server.empty() && std::is_same<socket_type, boost::asio::ip::tcp::socket>::value)
-                corrected_path="http://"+host+':'+std::to_string(port)+corrected_path;
-            
-            content.seekp(0, std::ios::end);
-            auto content_length=content.tellp();
-            content.seekp(0, std::ios::beg);
-            
-            boost::asio::streambuf write_buffer;
-            std::ostream write_stream(&write_buffer);
-            write_stream << request_type << " " << corrected_path << " HTTP/1.1\r\n";
-            write_stream << "Host: " << host << "\r\n";
-            for(auto& h: header) {
-                write_stream << h.first << ": " << h.second << "\r\n";
+            std::stringstream content_stream;
+            content_stream << content.rdbuf();
+            return request(request_type, path, content_stream.str(), header);
+        }
+
+        /// Sends requests on one connection, all in one write without waiting for responses in between (HTTP pipelining),
+        /// and calls callback with the responses in the order of requests. If the server closes the connection before it has
+        /// answered all of them, the unanswered requests are sent again on a new connection where that is safe, see BatchRequest.
+        /// On errors, callback gets the responses read until then. config.timeout applies to the whole batch.
+        void async_batch(const std::vector<BatchRequest> &requests, const BatchCallback &callback) {
+            if(requests.empty()) {
+                io_service->post([callback] {
+                    callback(std::vector<std::shared_ptr<Response> >(), boost::system::error_code());
+                });
+                return;
             }
-            if(content_length>0)
-                write_stream << "Content-Length: " << content_length << "\r\n";
-            write_stream << "\r\n";
-            if(content_length>0)
-                write_stream << content.rdbuf();
-            
-            connect();
-            
-            auto timer=get_timeout_timer();
-            boost::asio::async_write(*socket, write_buffer,
-                                     [this, timer](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
-                if(timer)
-                    timer->cancel();
-                if(ec) {
-                    std::lock_guard<std::mutex> lock(socket_mutex);
-                    socket=nullptr;
-                    throw boost::system::system_error(ec);
-                }
+            std::vector<std::string> batch;
+            batch.reserve(requests.size());
+            for(auto &request: requests)
+                batch.emplace_back(make_request(request.request_type, request.path, request.content, request.header));
+            auto session=std::make_shared<Session>(std::move(batch), callback);
+            for(auto &request: requests)
+                session->content_handlers.emplace_back(request.content_handler);
+            assign(session);
+        }
+
+        /// As async_batch() with a callback, but returns the responses through a future, which throws
+        /// boost::system::system_error if the batch fails.
+        std::future<std::vector<std::shared_ptr<Response> > > async_batch(const std::vector<BatchRequest> &requests) {
+            auto promise=std::make_shared<std::promise<std::vector<std::shared_ptr<Response> > > >();
+            auto future=promise->get_future();
+            async_batch(requests, [promise](const std::vector<std::shared_ptr<Response> > &responses, const boost::system::error_code &ec) {
+                if(ec)
+                    promise->set_exception(std::make_exception_ptr(boost::system::system_error(ec)));
+                else
+                    promise->set_value(responses);
             });
-            io_service.reset();
-            io_service.run();
-            
-            return request_read();
+            return future;
+        }
+
+        /// Sends requests as async_batch() does, and waits for the responses. Throws boost::system::system_error if the batch fails.
+        std::vector<std::shared_ptr<Response> > batch(const std::vector<BatchRequest> &requests) {
+            auto future=async_batch(requests);
+            return wait(future);
         }
         
+        /// Closes all connections. Requests in flight, and requests waiting for a connection, fail with boost::asio::error::operation_aborted.
         void close() {
-            std::lock_guard<std::mutex> lock(socket_mutex);
-            if(socket) {
-                boost::system::error_code ec;
-                socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-                socket->lowest_layer().close();
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            for(auto &connection: connections) {
+                connection->strand.post([connection] {
+                    connection->close();
+                });
             }
+            connections.clear();
+            for(auto &session: waiting) {
+                io_service->post([session] {
+                    session->callback(session->responses, boost::asio::error::operation_aborted);
+                });
+            }
+            waiting.clear();
         }
         
     protected:
-        boost::asio::io_service io_service;
-        boost::asio::ip::tcp::resolver resolver;
+        class Connection {
+        public:
+            Connection(boost::asio::io_service &io_service): strand(io_service), timer(io_service), in_use(false), starts(0), reused(false), reaped(false) {}
+
+            std::unique_ptr<socket_type> socket;
+            ///Serializes the handlers of the connection, which may run on several threads of io_service
+            boost::asio::io_service::strand strand;
+            ///Timeout of the current request, or of the idle connection
+            boost::asio::deadline_timer timer;
+            ///Set while a request is sent or read on the connection, guarded by connections_mutex
+            bool in_use;
+            ///Number of requests started on the connection, so that an idle timeout that expired while a request
+            ///took the connection does not close it
+            size_t starts;
+            ///Set once a response has been read on the connection. The server may have closed it since, so a failure
+            ///of the next request before it has received anything is retried on a new connection, if the request is
+            ///idempotent (GET, HEAD, PUT, DELETE or OPTIONS) or had not been written when the connection failed.
+            bool reused;
+            ///Set when the connection has been closed for being idle too long, it is then removed from connections
+            std::atomic<bool> reaped;
+            ///Received bytes that have not been parsed yet, which may include the beginning of the next pipelined response
+            boost::asio::streambuf buffer;
+
+            void close() {
+                boost::system::error_code ec;
+                timer.cancel(ec);
+                if(socket) {
+                    socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                    socket->lowest_layer().close(ec);
+                }
+            }
+        };
+
+        ///Requests sent on one connection, and their responses
+        class Session {
+        public:
+            Session(std::vector<std::string> &&requests, const BatchCallback &callback): requests(std::move(requests)), callback(callback),
+                    content_size(0), attempt(0), attempt_start(0), writing(false), written(0), retried(false), timed_out(false), finished(false) {}
+            std::shared_ptr<Connection> connection;
+            ///The header and content of the requests, kept to send the unanswered ones again on a new connection
+            std::vector<std::string> requests;
+            ///Responses read so far, in the order of requests
+            std::vector<std::shared_ptr<Response> > responses;
+            ///Response being read
+            std::shared_ptr<Response> response;
+            BatchCallback callback;
+            ///Content handlers of the requests, empty ones store the content in the response
+            std::vector<ContentHandler> content_handlers;
+            ///Size of the content of response received so far
+            size_t content_size;
+            ///Incremented whenever the requests are sent on a new connection, to ignore the handlers of the previous one
+            size_t attempt;
+            ///Number of responses that had been read when the current connection was started
+            size_t attempt_start;
+            ///Set while the requests are written
+            bool writing;
+            ///Bytes of the requests written on the current connection, once the write has completed or failed
+            size_t written;
+            boost::system::error_code write_error;
+            bool retried;
+            bool timed_out;
+            bool finished;
+        };
+
+        std::shared_ptr<boost::asio::io_service> own_io_service;
+
+        ///Bytes read at most at once for content handlers, and for content that ends with the connection
+        static const size_t content_buffer_size=64*1024;
         
-        std::unique_ptr<socket_type> socket;
-        std::mutex socket_mutex;
+        ///Protects connections, waiting and the cached addresses
+        std::mutex connections_mutex;
+        std::vector<std::shared_ptr<Connection> > connections;
+        ///Requests waiting for a connection, oldest first
+        std::deque<std::shared_ptr<Session> > waiting;
+        ///Resolved addresses of the server, shared with the connects using them
+        std::shared_ptr<const std::vector<boost::asio::ip::tcp::endpoint> > endpoints;
+        std::chrono::steady_clock::time_point endpoints_expiry;
         
         std::string host;
         unsigned short port;
                 
-        ClientBase(const std::string& host_port, unsigned short default_port) : resolver(io_service) {
+        ClientBase(const std::string& host_port, unsigned short default_port): io_service(new boost::asio::io_service()), own_io_service(io_service) {
             auto parsed_host_port=parse_host_port(host_port, default_port);
             host=parsed_host_port.first;
             port=parsed_host_port.second;
@@ -225,25 +352,484 @@ namespace SimpleWeb {
             return parsed_host_port;
         }
         
-        virtual void connect()=0;
-        
-        std::shared_ptr<boost::asio::deadline_timer> get_timeout_timer() {
-            if(config.timeout==0)
-                return nullptr;
+        std::string make_request(const std::string& request_type, const std::string& path, boost::string_ref content,
+                const std::map<std::string, std::string>& header) const {
+            auto corrected_path=path;
+            if(corrected_path=="")
+                corrected_path="/";
+            if(!config.proxy_server.empty() && std::is_same<socket_type, boost::asio::ip::tcp::socket>::value)
+                corrected_path="http://"+host+':'+std::to_string(port)+corrected_path;
             
-            auto timer=std::make_shared<boost::asio::deadline_timer>(io_service);
-            timer->expires_from_now(boost::posix_time::seconds(config.timeout));
-            timer->async_wait([this](const boost::system::error_code& ec) {
-                if(!ec) {
-                    close();
+            std::string request;
+            request.reserve(corrected_path.size()+host.size()+content.size()+128);
+            request+=request_type+" "+corrected_path+" HTTP/1.1\r\n";
+            request+="Host: "+host+"\r\n";
+            for(auto& h: header)
+                request+=h.first+": "+h.second+"\r\n";
+            if(content.size()>0)
+                request+="Content-Length: "+std::to_string(content.size())+"\r\n";
+            request+="\r\n";
+            request.append(content.data(), content.size());
+            return request;
+        }
+
+        ///Returns the result of future, running the io_service of the client meanwhile if it is used
+        template<class result_type>
+        result_type wait(std::future<result_type> &future) {
+            if(io_service==own_io_service) {
+                //Runs only until the response has been read, the connection may remain open for the next request
+                io_service->reset();
+                while(future.wait_for(std::chrono::seconds(0))!=std::future_status::ready) {
+                    if(io_service->run_one()==0)
+                        break;
                 }
+            }
+            return future.get();
+        }
+
+        ///Opens the socket of session->connection, and calls write(session) once it is connected
+        virtual void connect(const std::shared_ptr<Session> &session)=0;
+
+        ///Starts session on an idle connection, or on a new one, or queues it if config.max_connections are in use
+        void assign(const std::shared_ptr<Session> &session) {
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                session->connection=get_connection();
+                if(!session->connection) {
+                    waiting.emplace_back(session);
+                    return;
+                }
+            }
+            session->connection->strand.post([this, session] {
+                start(session);
             });
-            return timer;
+        }
+
+        ///Returns an idle connection, or a new one that is not connected yet, or nullptr if config.max_connections are in use.
+        ///Is called with connections_mutex locked.
+        std::shared_ptr<Connection> get_connection() {
+            connections.erase(std::remove_if(connections.begin(), connections.end(), [](const std::shared_ptr<Connection> &connection) {
+                return connection->reaped && !connection->in_use;
+            }), connections.end());
+            //The most recently used connection is the least likely to have been closed by the server
+            for(auto it=connections.rbegin();it!=connections.rend();++it) {
+                if(!(*it)->in_use) {
+                    (*it)->in_use=true;
+                    return *it;
+                }
+            }
+            if(config.max_connections>0 && connections.size()>=config.max_connections)
+                return nullptr;
+            connections.emplace_back(std::make_shared<Connection>(*io_service));
+            connections.back()->in_use=true;
+            return connections.back();
+        }
+
+        ///Makes connection available to the next request, or closes it if close is set. Is called on the strand of connection.
+        void release_connection(const std::shared_ptr<Connection> &connection, bool close) {
+            std::shared_ptr<Session> next;
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                if(close) {
+                    connection->close();
+                    auto it=std::find(connections.begin(), connections.end(), connection);
+                    if(it!=connections.end())
+                        connections.erase(it);
+                }
+                else
+                    connection->reused=true;
+                if(!waiting.empty()) {
+                    next=waiting.front();
+                    waiting.pop_front();
+                    if(close) {
+                        connections.emplace_back(std::make_shared<Connection>(*io_service));
+                        connections.back()->in_use=true;
+                        next->connection=connections.back();
+                    }
+                    else
+                        next->connection=connection;
+                }
+                else if(!close) {
+                    connection->in_use=false;
+                    //Moves the connection to the back, where get_connection() looks first
+                    auto it=std::find(connections.begin(), connections.end(), connection);
+                    if(it!=connections.end())
+                        std::rotate(it, it+1, connections.end());
+                }
+            }
+            if(!close && !next && config.idle_timeout>0) {
+                auto starts=connection->starts;
+                connection->timer.expires_from_now(boost::posix_time::seconds(static_cast<long>(config.idle_timeout)));
+                connection->timer.async_wait(connection->strand.wrap([connection, starts](const boost::system::error_code &ec) {
+                    //start() cancels the timer, but the handler may have been queued already. A request that has taken
+                    //the connection and not started yet reconnects in start().
+                    if(!ec && connection->starts==starts) {
+                        connection->reaped=true;
+                        connection->close();
+                    }
+                }));
+            }
+            if(next) {
+                next->connection->strand.post([this, next] {
+                    start(next);
+                });
+            }
+        }
+
+        ///False if the server has closed the idle connection, or sent something unexpected on it
+        static bool healthy(Connection &connection) {
+            auto &socket=connection.socket->lowest_layer();
+            if(!socket.is_open() || connection.buffer.size()>0)
+                return false;
+            //Nothing to read yet, neither data nor the end of the stream
+            char byte;
+            auto received=::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            return received<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
+        }
+
+        ///Returns the cached addresses of the server, or none if they have to be resolved
+        std::shared_ptr<const std::vector<boost::asio::ip::tcp::endpoint> > cached_endpoints() {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            if(std::chrono::steady_clock::now()>=endpoints_expiry)
+                endpoints=std::make_shared<std::vector<boost::asio::ip::tcp::endpoint> >();
+            return endpoints;
+        }
+
+        void cache_endpoints(const std::shared_ptr<const std::vector<boost::asio::ip::tcp::endpoint> > &resolved) {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            endpoints=resolved;
+            endpoints_expiry=std::chrono::steady_clock::now()+std::chrono::seconds(config.dns_cache_time);
+        }
+
+        void start(const std::shared_ptr<Session> &session) {
+            auto connection=session->connection;
+            connection->starts++;
+            session->attempt++;
+            session->attempt_start=session->responses.size();
+            session->written=0;
+            session->write_error=boost::system::error_code();
+            bool connected=connection->socket && connection->reused && healthy(*connection);
+            if(!connected) {
+                connection->reaped=false;
+                connection->reused=false;
+                connection->close();
+                connection->buffer.consume(connection->buffer.size());
+            }
+            //Replaces the idle timeout of a reused connection
+            if(config.timeout>0) {
+                connection->timer.expires_from_now(boost::posix_time::seconds(static_cast<long>(config.timeout)));
+                connection->timer.async_wait(connection->strand.wrap([session](const boost::system::error_code &ec) {
+                    if(!ec && !session->finished) {
+                        session->timed_out=true;
+                        session->connection->close();
+                    }
+                }));
+            }
+            else {
+                boost::system::error_code timer_ec;
+                connection->timer.cancel(timer_ec);
+            }
+            if(connected)
+                write(session);
+            else
+                connect(session);
+        }
+
+        ///Writes the unanswered requests in one write, and reads their responses meanwhile, so that neither side waits
+        ///for the other to read when many requests are pipelined
+        void write(const std::shared_ptr<Session> &session) {
+            auto connection=session->connection;
+            std::vector<boost::asio::const_buffer> buffers;
+            buffers.reserve(session->requests.size()-session->responses.size());
+            for(auto it=session->requests.begin()+static_cast<std::ptrdiff_t>(session->responses.size());it!=session->requests.end();++it)
+                buffers.emplace_back(boost::asio::buffer(*it));
+            session->writing=true;
+            auto attempt=session->attempt;
+            boost::asio::async_write(*connection->socket, buffers, connection->strand.wrap([session, attempt](const boost::system::error_code &ec, size_t bytes_transferred) {
+                if(attempt!=session->attempt || session->finished)
+                    return;
+                session->writing=false;
+                session->written=bytes_transferred;
+                if(ec) {
+                    //Ends the read of the responses, which reports write_error
+                    session->write_error=ec;
+                    boost::system::error_code close_ec;
+                    session->connection->socket->lowest_layer().close(close_ec);
+                }
+            }));
+            read_response(session);
+        }
+
+        void read_response(const std::shared_ptr<Session> &session) {
+            auto connection=session->connection;
+            session->response=std::shared_ptr<Response>(new Response());
+            session->content_size=0;
+            boost::asio::async_read_until(*connection->socket, connection->buffer, "\r\n\r\n",
+                                          connection->strand.wrap([this, session](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
+                if(ec) {
+                    finish(session, ec);
+                    return;
+                }
+                auto &response=session->response;
+                std::istream stream(&session->connection->buffer);
+                parse_response_header(response, stream);
+                
+                auto header_it=response->header.find("Content-Length");
+                if(!has_content(session->requests[session->responses.size()], *response))
+                    read_done(session);
+                else if(header_it!=response->header.end()) {
+                    size_t length;
+                    try {
+                        length=stoull(header_it->second);
+                    }
+                    catch(const std::exception &) {
+                        finish(session, boost::asio::error::invalid_argument);
+                        return;
+                    }
+                    read_content(session, length, [this, session] {
+                        read_done(session);
+                    });
+                }
+                else if((header_it=response->header.find("Transfer-Encoding"))!=response->header.end() && header_it->second=="chunked")
+                    read_chunked(session);
+                else if(!keep_alive(*response))
+                    read_until_eof(session);
+                else
+                    read_done(session);
+            }));
+        }
+
+        ///Passes size bytes from connection->buffer to the content handler of the request, or into the content of the response
+        void deliver(const std::shared_ptr<Session> &session, size_t size) {
+            auto &buffer=session->connection->buffer;
+            auto &content_handler=session->content_handlers[session->responses.size()];
+            if(content_handler) {
+                content_handler(session->response, boost::asio::buffer_cast<const char*>(buffer.data()), size);
+                buffer.consume(size);
+            }
+            else
+                move(buffer, session->response->content_buffer, size);
+        }
+
+        ///Counts size more bytes of content, and fails session if that is too much
+        bool add_content_size(const std::shared_ptr<Session> &session, size_t size) {
+            session->content_size+=size;
+            if(config.max_content_size>0 && session->content_size>config.max_content_size) {
+                finish(session, boost::asio::error::message_size);
+                return false;
+            }
+            return true;
+        }
+
+        ///Reads length bytes of content, of which those already received are in connection->buffer, then calls next.
+        ///Without content handler, the bytes not received yet are read right into the content of the response.
+        void read_content(const std::shared_ptr<Session> &session, size_t length, const std::function<void()> &next) {
+            if(!add_content_size(session, length))
+                return;
+            read_content_part(session, length, next);
+        }
+
+        void read_content_part(const std::shared_ptr<Session> &session, size_t length, const std::function<void()> &next) {
+            auto &connection=*session->connection;
+            auto received=std::min(length, connection.buffer.size());
+            if(received>0) {
+                deliver(session, received);
+                length-=received;
+            }
+            if(length==0) {
+                next();
+                return;
+            }
+            if(!session->content_handlers[session->responses.size()]) {
+                boost::asio::async_read(*connection.socket, session->response->content_buffer, boost::asio::transfer_exactly(length),
+                                        connection.strand.wrap([this, session, next](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
+                    if(ec)
+                        finish(session, ec);
+                    else
+                        next();
+                }));
+            }
+            else {
+                connection.socket->async_read_some(connection.buffer.prepare(std::min(length, content_buffer_size)),
+                                                   connection.strand.wrap([this, session, length, next](const boost::system::error_code &ec, size_t bytes_transferred) {
+                    if(ec) {
+                        finish(session, ec);
+                        return;
+                    }
+                    session->connection->buffer.commit(bytes_transferred);
+                    read_content_part(session, length, next);
+                }));
+            }
+        }
+        
+        ///Decodes the chunks of the content in connection->buffer, whose data is passed on as it is received
+        void read_chunked(const std::shared_ptr<Session> &session) {
+            auto connection=session->connection;
+            boost::asio::async_read_until(*connection->socket, connection->buffer, "\r\n",
+                                          connection->strand.wrap([this, session](const boost::system::error_code &ec, size_t bytes_transferred) {
+                if(ec) {
+                    finish(session, ec);
+                    return;
+                }
+                auto &buffer=session->connection->buffer;
+                std::string line(boost::asio::buffer_cast<const char*>(buffer.data()), bytes_transferred-2);
+                buffer.consume(bytes_transferred);
+                size_t length;
+                try {
+                    length=stoul(line, 0, 16);
+                }
+                catch(const std::exception &) {
+                    finish(session, boost::asio::error::invalid_argument);
+                    return;
+                }
+                
+                if(length==0)
+                    read_trailer(session);
+                else {
+                    read_content(session, length, [this, session] {
+                        //Removes the "\r\n" after the data of the chunk
+                        auto &connection=*session->connection;
+                        if(connection.buffer.size()>=2) {
+                            connection.buffer.consume(2);
+                            read_chunked(session);
+                            return;
+                        }
+                        boost::asio::async_read(*connection.socket, connection.buffer, boost::asio::transfer_exactly(2-connection.buffer.size()),
+                                                connection.strand.wrap([this, session](const boost::system::error_code &ec, size_t /*bytes_transferred*/) {
+                            if(ec) {
+                                finish(session, ec);
+                                return;
+                            }
+                            session->connection->buffer.consume(2);
+                            read_chunked(session);
+                        }));
+                    });
+                }
+            }));
+        }
+
+        ///Skips the header fields after the last chunk, up to the empty line
+        void read_trailer(const std::shared_ptr<Session> &session) {
+            auto connection=session->connection;
+            boost::asio::async_read_until(*connection->socket, connection->buffer, "\r\n",
+                                          connection->strand.wrap([this, session](const boost::system::error_code &ec, size_t bytes_transferred) {
+                if(ec) {
+                    finish(session, ec);
+                    return;
+                }
+                session->connection->buffer.consume(bytes_transferred);
+                if(bytes_transferred==2)
+                    read_done(session);
+                else
+                    read_trailer(session);
+            }));
+        }
+
+        ///Reads content up to the end of the connection
+        void read_until_eof(const std::shared_ptr<Session> &session) {
+            auto &connection=*session->connection;
+            auto received=connection.buffer.size();
+            if(received>0) {
+                if(!add_content_size(session, received))
+                    return;
+                deliver(session, received);
+            }
+            auto content_handler=session->content_handlers[session->responses.size()];
+            auto &target=content_handler?connection.buffer:session->response->content_buffer;
+            connection.socket->async_read_some(target.prepare(content_buffer_size),
+                                               connection.strand.wrap([this, session, content_handler](const boost::system::error_code &ec, size_t bytes_transferred) {
+                if(ec==boost::asio::error::eof)
+                    read_done(session);
+                else if(ec)
+                    finish(session, ec);
+                else if(content_handler) {
+                    session->connection->buffer.commit(bytes_transferred);
+                    read_until_eof(session);
+                }
+                else {
+                    session->response->content_buffer.commit(bytes_transferred);
+                    if(add_content_size(session, bytes_transferred))
+                        read_until_eof(session);
+                }
+            }));
+        }
+
+        ///Reads the next response, or sends the unanswered requests again if the server closes the connection after this one
+        void read_done(const std::shared_ptr<Session> &session) {
+            auto response=session->response;
+            session->responses.emplace_back(response);
+            session->response.reset();
+            if(session->responses.size()==session->requests.size())
+                finish(session, boost::system::error_code());
+            else if(!keep_alive(*response)) {
+                session->connection->reused=false;
+                start(session);
+            }
+            else
+                read_response(session);
+        }
+
+        ///Ends session with ec, or reconnects and sends the unanswered requests again if the server has closed the connection:
+        ///after answering some of them, or while the connection was idle. This is only done if the unanswered requests are
+        ///idempotent or none of them has been written, since the server may have processed a request it did not answer,
+        ///and a connection that failed before answering anything is only retried once.
+        void finish(const std::shared_ptr<Session> &session, boost::system::error_code ec) {
+            if(session->finished)
+                return;
+            auto connection=session->connection;
+            if(ec==boost::asio::error::operation_aborted && session->write_error)
+                ec=session->write_error;
+            bool answered=session->responses.size()>session->attempt_start;
+            bool unanswered=(!session->response || session->response->http_version.empty()) && connection->buffer.size()==0;
+            bool resendable=(!session->writing && session->written==0) ||
+                    std::all_of(session->requests.begin()+static_cast<std::ptrdiff_t>(session->responses.size()), session->requests.end(), idempotent);
+            if(ec && !session->timed_out && unanswered && resendable && (answered || (connection->reused && !session->retried)) &&
+               (ec==boost::asio::error::eof || ec==boost::asio::error::connection_reset || ec==boost::asio::error::broken_pipe)) {
+                if(!answered)
+                    session->retried=true;
+                connection->reused=false;
+                start(session);
+                return;
+            }
+            session->finished=true;
+            boost::system::error_code timer_ec;
+            connection->timer.cancel(timer_ec);
+            if(session->timed_out)
+                ec=boost::asio::error::timed_out;
+            release_connection(connection, ec || session->writing || !keep_alive(*session->responses.back()));
+            session->callback(session->responses, ec);
+        }
+
+        ///True if request can be sent again without changing its effect on the server
+        static bool idempotent(const std::string &request) {
+            auto method=boost::string_ref(request).substr(0, request.find(' '));
+            return method=="GET" || method=="HEAD" || method=="PUT" || method=="DELETE" || method=="OPTIONS";
+        }
+
+        ///False if response has no content, whatever its header says
+        static bool has_content(const std::string &request, const Response &response) {
+            if(request.compare(0, 5, "HEAD ")==0)
+                return false;
+            return !(response.status_code.compare(0, 1, "1")==0 || response.status_code.compare(0, 3, "204")==0 ||
+                     response.status_code.compare(0, 3, "304")==0);
+        }
+
+        static void move(boost::asio::streambuf &from, boost::asio::streambuf &to, size_t size) {
+            to.commit(boost::asio::buffer_copy(to.prepare(size), from.data(), size));
+            from.consume(size);
+        }
+
+        ///True if the server keeps the connection open after response
+        static bool keep_alive(const Response &response) {
+            auto it=response.header.find("Connection");
+            if(it!=response.header.end() && boost::algorithm::iequals(it->second, "close"))
+                return false;
+            return response.http_version>="1.1";
         }
         
-        void parse_response_header(const std::shared_ptr<Response> &response) const {
+        void parse_response_header(const std::shared_ptr<Response> &response, std::istream &stream) const {
             std::string line;
-            getline(response->content, line);
+            getline(stream, line);
             size_t version_end=line.find(' ');
             if(version_end!=std::string::npos) {
                 if(5<line.size())
@@ -251,7 +837,7 @@ namespace SimpleWeb {
                 if((version_end+1)<line.size())
                     response->status_code=line.substr(version_end+1, line.size()-(version_end+1)-1);
 
-                getline(response->content, line);
+                getline(stream, line);
                 size_t param_end;
                 while((param_end=line.find(':'))!=std::string::npos) {
                     size_t value_start=param_end+1;
@@ -262,124 +848,15 @@ namespace SimpleWeb {
                             response->header.insert(std::make_pair(line.substr(0, param_end), line.substr(value_start, line.size()-value_start-1)));
                     }
 
-                    getline(response->content, line);
+                    getline(stream, line);
                 }
             }
         }
-        
-        std::shared_ptr<Response> request_read() {
-            std::shared_ptr<Response> response(new Response());
-            
-            boost::asio::streambuf chunked_streambuf;
-            
-            auto timer=get_timeout_timer();
-            boost::asio::async_read_until(*socket, response->content_buffer, "\r\n\r\n",
-                                          [this, &response, &chunked_streambuf, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
-                if(timer)
-                    timer->cancel();
-                if(!ec) {
-                    size_t num_additional_bytes=response->content_buffer.size()-bytes_transferred;
-                    
-                    parse_response_header(response);
-                                        
-                    auto header_it=response->header.find("Content-Length");
-                    if(header_it!=response->header.end()) {
-                        auto content_length=stoull(header_it->second);
-                        if(content_length>num_additional_bytes) {
-                            auto timer=get_timeout_timer();
-                            boost::asio::async_read(*socket, response->content_buffer,
-                                                    boost::asio::transfer_exactly(content_length-num_additional_bytes),
-                                                    [this, timer](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
-                                if(timer)
-                                    timer->cancel();
-                                if(ec) {
-                                    std::lock_guard<std::mutex> lock(socket_mutex);
-                                    this->socket=nullptr;
-                                    throw boost::system::system_error(ec);
-                                }
-                            });
-                        }
-                    }
-                    else if((header_it=response->header.find("Transfer-Encoding"))!=response->header.end() && header_it->second=="chunked") {
-                        request_read_chunked(response, chunked_streambuf);
-                    }
-                }
-                else {
-                    std::lock_guard<std::mutex> lock(socket_mutex);
-                    socket=nullptr;
-                    throw boost::system::system_error(ec);
-                }
-            });
-            io_service.reset();
-            io_service.run();
-            
-            return response;
-        }
-        
-        void request_read_chunked(const std::shared_ptr<Response> &response, boost::asio::streambuf &streambuf) {
-            auto timer=get_timeout_timer();
-            boost::asio::async_read_until(*socket, response->content_buffer, "\r\n",
-                                      [this, &response, &streambuf, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
-                if(timer)
-                    timer->cancel();
-                if(!ec) {
-                    std::string line;
-                    getline(response->content, line);
-                    bytes_transferred-=line.size()+1;
-                    line.pop_back();
-                    std::streamsize length=stol(line, 0, 16);
-                    
-                    auto num_additional_bytes=static_cast<std::streamsize>(response->content_buffer.size()-bytes_transferred);
-                    
-                    auto post_process=[this, &response, &streambuf, length] {
-                        std::ostream stream(&streambuf);
-                        if(length>0) {
-                            std::vector<char> buffer(static_cast<size_t>(length));
-                            response->content.read(&buffer[0], length);
-                            stream.write(&buffer[0], length);
-                        }
-                        
-                        //Remove "\r\n"
-                        response->content.get();
-                        response->content.get();
-                        
-                        if(length>0)
-                            request_read_chunked(response, streambuf);
-                        else {
-                            std::ostream response_stream(&response->content_buffer);
-                            response_stream << stream.rdbuf();
-                        }
-                    };
-                    
-                    if((2+length)>num_additional_bytes) {
-                        auto timer=get_timeout_timer();
-                        boost::asio::async_read(*socket, response->content_buffer,
-                                                boost::asio::transfer_exactly(2+length-num_additional_bytes),
-                                                [this, post_process, timer](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
-                            if(timer)
-                                timer->cancel();
-                            if(!ec) {
-                                post_process();
-                            }
-                            else {
-                                std::lock_guard<std::mutex> lock(socket_mutex);
-                                this->socket=nullptr;
-                                throw boost::system::system_error(ec);
-                            }
-                        });
-                    }
-                    else
-                        post_process();
-                }
-                else {
-                    std::lock_guard<std::mutex> lock(socket_mutex);
-                    socket=nullptr;
-                    throw boost::system::system_error(ec);
-                }
-            });
-        }
     };
     
+    template<class socket_type>
+    const size_t ClientBase<socket_type>::content_buffer_size;
+    
     template<class socket_type>
     class Client : public ClientBase<socket_type> {};
     
@@ -391,45 +868,45 @@ namespace SimpleWeb {
         Client(const std::string& server_port_path) : ClientBase<HTTP>::ClientBase(server_port_path, 80) {}
         
     protected:
-        void connect() {
-            if(!socket || !socket->is_open()) {
-                std::unique_ptr<boost::asio::ip::tcp::resolver::query> query;
-                if(config.proxy_server.empty())
-                    query=std::unique_ptr<boost::asio::ip::tcp::resolver::query>(new boost::asio::ip::tcp::resolver::query(host, std::to_string(port)));
-                else {
-                    auto proxy_host_port=parse_host_port(config.proxy_server, 8080);
-                    query=std::unique_ptr<boost::asio::ip::tcp::resolver::query>(new boost::asio::ip::tcp::resolver::query(proxy_host_port.first, std::to_string(proxy_host_port.second)));
-                }
-                resolver.async_resolve(*query, [this](const boost::system::error_code &ec,
-                                                     boost::asio::ip::tcp::resolver::iterator it){
-                    if(!ec) {
-                        {
-                            std::lock_guard<std::mutex> lock(socket_mutex);
-                            socket=std::unique_ptr<HTTP>(new HTTP(io_service));
-                        }
-                        
-                        boost::asio::async_connect(*socket, it, [this]
-                                (const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::iterator /*it*/){
-                            if(!ec) {
-                                boost::asio::ip::tcp::no_delay option(true);
-                                this->socket->set_option(option);
-                            }
-                            else {
-                                std::lock_guard<std::mutex> lock(socket_mutex);
-                                this->socket=nullptr;
-                                throw boost::system::system_error(ec);
-                            }
-                        });
-                    }
-                    else {
-                        std::lock_guard<std::mutex> lock(socket_mutex);
-                        socket=nullptr;
-                        throw boost::system::system_error(ec);
-                    }
-                });
-                io_service.reset();
-                io_service.run();
+        void connect(const std::shared_ptr<Session> &session) override {
+            auto endpoints=cached_endpoints();
+            if(!endpoints->empty()) {
+                connect(session, endpoints);
+                return;
             }
+            std::pair<std::string, unsigned short> host_port(host, port);
+            if(!config.proxy_server.empty())
+                host_port=parse_host_port(config.proxy_server, 8080);
+            auto resolver=std::make_shared<boost::asio::ip::tcp::resolver>(*io_service);
+            auto query=std::make_shared<boost::asio::ip::tcp::resolver::query>(host_port.first, std::to_string(host_port.second));
+            resolver->async_resolve(*query, session->connection->strand.wrap([this, session, resolver, query](const boost::system::error_code &ec,
+                                                                                                              boost::asio::ip::tcp::resolver::iterator it) {
+                if(ec) {
+                    finish(session, ec);
+                    return;
+                }
+                auto endpoints=std::make_shared<std::vector<boost::asio::ip::tcp::endpoint> >(it, boost::asio::ip::tcp::resolver::iterator());
+                cache_endpoints(endpoints);
+                connect(session, endpoints);
+            }));
+        }
+
+        void connect(const std::shared_ptr<Session> &session, const std::shared_ptr<const std::vector<boost::asio::ip::tcp::endpoint> > &endpoints) {
+            auto &connection=*session->connection;
+            connection.socket=std::unique_ptr<HTTP>(new HTTP(*io_service));
+            boost::asio::async_connect(*connection.socket, endpoints->begin(), endpoints->end(), connection.strand.wrap([this, session, endpoints](const boost::system::error_code &ec,
+                                                                                                                                     std::vector<boost::asio::ip::tcp::endpoint>::const_iterator /*it*/) {
+                if(ec) {
+                    //The server may have moved, it is resolved again for the next connection
+                    cache_endpoints(std::make_shared<std::vector<boost::asio::ip::tcp::endpoint> >());
+                    finish(session, ec);
+                    return;
+                }
+                boost::asio::ip::tcp::no_delay option(true);
+                boost::system::error_code option_ec;
+                session->connection->socket->set_option(option, option_ec);
+                write(session);
+            }));
         }
     };
 }
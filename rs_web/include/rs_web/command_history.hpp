@@ -0,0 +1,215 @@
+#ifndef COMMAND_HISTORY_HPP
+#define	COMMAND_HISTORY_HPP
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace SimpleWeb {
+    ///The last capacity commands, in a ring buffer that readers access without a lock, and optionally kept in an append-only
+    ///log file to survive restarts. Every command is appended to the log as one record "<size>:<command>\n". When the
+    ///log holds twice as many records as the ring, it is compacted to the records in the ring.
+    class CommandHistory {
+    public:
+        ///Loads the commands in the log at path, if path is not empty. Throws std::runtime_error if the log cannot be opened.
+        CommandHistory(size_t capacity, const std::string &path=std::string()): slots(std::max<size_t>(capacity, 1)),
+                path(path), fd(-1), log_records(0), count(0) {
+            if(!path.empty())
+                open_log();
+        }
+        ~CommandHistory() {
+            if(fd>=0)
+                ::close(fd);
+        }
+
+        CommandHistory(const CommandHistory&)=delete;
+        CommandHistory &operator=(const CommandHistory&)=delete;
+
+        ///Throws std::runtime_error if the log cannot be written. command is then not added to the ring either.
+        void append(const std::string &command) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(fd>=0) {
+                auto log_size=::lseek(fd, 0, SEEK_END);
+                try {
+                    write_record(fd, command);
+                }
+                catch(...) {
+                    //Remove a partly written record, which would hide the records appended after it
+                    if(log_size>=0) {
+                        auto result=::ftruncate(fd, log_size);
+                        (void)result;
+                    }
+                    throw;
+                }
+                log_records++;
+            }
+
+            auto sequence=count.load(std::memory_order_relaxed);
+            publish(sequence, command);
+            count.store(sequence+1, std::memory_order_release);
+
+            if(fd>=0 && log_records>=2*slots.size()) {
+                //The log still holds every command if compaction fails, and compaction is tried again on the next append
+                try {
+                    compact();
+                }
+                catch(const std::runtime_error &) {}
+            }
+        }
+
+        ///Number of commands in the ring
+        size_t size() const {
+            return static_cast<size_t>(std::min<uint64_t>(count.load(std::memory_order_acquire), slots.size()));
+        }
+
+        ///Returns the command index commands before the last one, or nullptr if it is not in the ring. Takes no lock,
+        ///and the command stays valid while it is held, even if it is replaced in the ring in the meantime.
+        std::shared_ptr<const std::string> get(size_t index) const {
+            auto total=count.load(std::memory_order_acquire);
+            if(index>=std::min<uint64_t>(total, slots.size()))
+                return nullptr;
+            auto sequence=total-1-index;
+            auto &slot=slots[sequence%slots.size()];
+            std::shared_ptr<const Entry> entry;
+            slot.readers.fetch_add(1);
+            if(auto pointer=slot.entry.load())
+                entry=pointer->shared_from_this();
+            slot.readers.fetch_sub(1);
+            //The slot has been reused by a concurrent append
+            if(!entry || entry->sequence!=sequence)
+                return nullptr;
+            return std::shared_ptr<const std::string>(entry, &entry->command);
+        }
+
+    private:
+        class Entry: public std::enable_shared_from_this<Entry> {
+        public:
+            Entry(uint64_t sequence, const std::string &command): sequence(sequence), command(command) {}
+            uint64_t sequence;
+            std::string command;
+        };
+
+        ///Readers take a reference to entry while readers is raised. A replaced entry is only released by the slot
+        ///once readers has dropped to 0, so that no reader can be taking a reference to it any more.
+        class Slot {
+        public:
+            Slot(): entry(nullptr), readers(0) {}
+            std::atomic<const Entry*> entry;
+            mutable std::atomic<unsigned> readers;
+            ///Keeps entry alive, only used by appends
+            std::shared_ptr<const Entry> owner;
+        };
+
+        std::vector<Slot> slots;
+        std::string path;
+        int fd;
+        ///Records in the log file, including those that are no longer in the ring
+        size_t log_records;
+        ///Protects the log and appends, readers only use count and slots
+        std::mutex mutex;
+        std::atomic<uint64_t> count;
+
+        void open_log() {
+            fd=::open(path.c_str(), O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+            if(fd<0)
+                throw std::runtime_error("could not open "+path+": "+std::strerror(errno));
+            std::string log;
+            char buffer[65536];
+            ssize_t read_length;
+            while((read_length=::read(fd, buffer, sizeof(buffer)))>0)
+                log.append(buffer, static_cast<size_t>(read_length));
+
+            size_t position=0;
+            while(position<log.size()) {
+                auto separator=log.find(':', position);
+                if(separator==std::string::npos || separator==position || separator-position>20)
+                    break;
+                uint64_t size=0;
+                bool valid=true;
+                for(auto c=position;c<separator;c++) {
+                    if(log[c]<'0' || log[c]>'9')
+                        valid=false;
+                    size=size*10+static_cast<uint64_t>(log[c]-'0');
+                }
+                if(!valid || size>log.size()-separator-1 || separator+1+size>=log.size() || log[separator+1+size]!='\n')
+                    break;
+                auto sequence=count.load(std::memory_order_relaxed);
+                publish(sequence, log.substr(separator+1, size));
+                count.store(sequence+1, std::memory_order_relaxed);
+                log_records++;
+                position=separator+1+size+1;
+            }
+            //Drop a record that was cut off by a crash, so that the next record is appended after a complete one
+            if(position<log.size()) {
+                if(::ftruncate(fd, static_cast<off_t>(position))!=0)
+                    throw std::runtime_error("could not truncate "+path+": "+std::strerror(errno));
+            }
+            if(log_records>=2*slots.size())
+                compact();
+        }
+
+        ///Replaces the entry in the slot of sequence. The accesses to entry and readers are sequentially consistent,
+        ///so that a reader either is seen by the wait, or loads the new entry.
+        void publish(uint64_t sequence, const std::string &command) {
+            auto &slot=slots[sequence%slots.size()];
+            auto replaced=std::move(slot.owner);
+            slot.owner=std::make_shared<const Entry>(sequence, command);
+            slot.entry.store(slot.owner.get());
+            while(slot.readers.load()!=0)
+                std::this_thread::yield();
+        }
+
+        static void write_record(int fd, const std::string &command) {
+            auto record=std::to_string(command.size())+":"+command+"\n";
+            size_t written=0;
+            while(written<record.size()) {
+                auto write_length=::write(fd, record.data()+written, record.size()-written);
+                if(write_length<0) {
+                    if(errno==EINTR)
+                        continue;
+                    throw std::runtime_error("could not write to log: "+std::string(std::strerror(errno)));
+                }
+                written+=static_cast<size_t>(write_length);
+            }
+        }
+
+        ///Replaces the log with the commands in the ring. The new log is written next to it and renamed over it,
+        ///so that a crash leaves either log complete.
+        void compact() {
+            auto compacted_path=path+".compact";
+            int compacted_fd=::open(compacted_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+            if(compacted_fd<0)
+                throw std::runtime_error("could not open "+compacted_path+": "+std::strerror(errno));
+            auto total=count.load(std::memory_order_relaxed);
+            auto first=total-std::min<uint64_t>(total, slots.size());
+            try {
+                for(auto sequence=first;sequence<total;sequence++)
+                    write_record(compacted_fd, slots[sequence%slots.size()].owner->command);
+            }
+            catch(...) {
+                ::close(compacted_fd);
+                throw;
+            }
+            if(::fsync(compacted_fd)!=0 || ::rename(compacted_path.c_str(), path.c_str())!=0) {
+                ::close(compacted_fd);
+                throw std::runtime_error("could not replace "+path+": "+std::strerror(errno));
+            }
+            ::close(fd);
+            fd=compacted_fd;
+            log_records=static_cast<size_t>(total-first);
+        }
+    };
+}
+#endif	/* COMMAND_HISTORY_HPP */
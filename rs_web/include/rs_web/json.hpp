@@ -0,0 +1,544 @@
+#ifndef JSON_HPP
+#define	JSON_HPP
+
+#include <boost/utility/string_ref.hpp>
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+namespace SimpleWeb {
+    ///Event based (SAX) JSON parser working on the received bytes. handler_type has the members
+    ///  void null_value(), void boolean_value(bool), void number_value(double value, boost::string_ref text),
+    ///  void string_value(boost::string_ref), void start_object(), void key(boost::string_ref), void end_object(),
+    ///  void start_array() and void end_array().
+    ///Strings without escape sequences are passed as views of the input, others are unescaped into a buffer
+    ///that is reused, so the views are only valid during the call. Invalid input throws std::invalid_argument.
+    class JsonReader {
+    public:
+        JsonReader(size_t max_depth=64): max_depth(max_depth), data(nullptr), end(nullptr), position(nullptr), depth(0) {}
+
+        template<class handler_type>
+        void parse(boost::string_ref input, handler_type &handler) {
+            data=position=input.data();
+            end=data+input.size();
+            depth=0;
+            skip_whitespace();
+            parse_value(handler);
+            skip_whitespace();
+            if(position!=end)
+                error("unexpected data after the value");
+        }
+
+    private:
+        size_t max_depth;
+        const char *data, *end, *position;
+        size_t depth;
+        std::string buffer;
+
+        void error(const char *message) {
+            throw std::invalid_argument("invalid JSON at position "+std::to_string(position-data)+": "+message);
+        }
+
+        void skip_whitespace() {
+            while(position!=end && (*position==' ' || *position=='\t' || *position=='\n' || *position=='\r'))
+                position++;
+        }
+
+        void expect(boost::string_ref literal) {
+            if(static_cast<size_t>(end-position)<literal.size() || boost::string_ref(position, literal.size())!=literal)
+                error("invalid literal");
+            position+=literal.size();
+        }
+
+        template<class handler_type>
+        void parse_value(handler_type &handler) {
+            if(position==end)
+                error("unexpected end");
+            switch(*position) {
+            case '{':
+                parse_object(handler);
+                break;
+            case '[':
+                parse_array(handler);
+                break;
+            case '"':
+                handler.string_value(parse_string());
+                break;
+            case 't':
+                expect("true");
+                handler.boolean_value(true);
+                break;
+            case 'f':
+                expect("false");
+                handler.boolean_value(false);
+                break;
+            case 'n':
+                expect("null");
+                handler.null_value();
+                break;
+            default:
+                parse_number(handler);
+            }
+        }
+
+        template<class handler_type>
+        void parse_object(handler_type &handler) {
+            if(++depth>max_depth)
+                error("too deeply nested");
+            position++;
+            handler.start_object();
+            skip_whitespace();
+            if(position!=end && *position=='}')
+                position++;
+            else {
+                while(true) {
+                    if(position==end || *position!='"')
+                        error("expected a key");
+                    handler.key(parse_string());
+                    skip_whitespace();
+                    if(position==end || *position!=':')
+                        error("expected ':'");
+                    position++;
+                    skip_whitespace();
+                    parse_value(handler);
+                    skip_whitespace();
+                    if(position!=end && *position==',') {
+                        position++;
+                        skip_whitespace();
+                        continue;
+                    }
+                    if(position==end || *position!='}')
+                        error("expected ',' or '}'");
+                    position++;
+                    break;
+                }
+            }
+            handler.end_object();
+            depth--;
+        }
+
+        template<class handler_type>
+        void parse_array(handler_type &handler) {
+            if(++depth>max_depth)
+                error("too deeply nested");
+            position++;
+            handler.start_array();
+            skip_whitespace();
+            if(position!=end && *position==']')
+                position++;
+            else {
+                while(true) {
+                    parse_value(handler);
+                    skip_whitespace();
+                    if(position!=end && *position==',') {
+                        position++;
+                        skip_whitespace();
+                        continue;
+                    }
+                    if(position==end || *position!=']')
+                        error("expected ',' or ']'");
+                    position++;
+                    break;
+                }
+            }
+            handler.end_array();
+            depth--;
+        }
+
+        template<class handler_type>
+        void parse_number(handler_type &handler) {
+            auto begin=position;
+            if(position!=end && *position=='-')
+                position++;
+            if(position==end || *position<'0' || *position>'9')
+                error("unexpected character");
+            if(*position=='0')
+                position++;
+            else
+                skip_digits();
+            if(position!=end && *position=='.') {
+                position++;
+                if(position==end || *position<'0' || *position>'9')
+                    error("expected a digit");
+                skip_digits();
+            }
+            if(position!=end && (*position=='e' || *position=='E')) {
+                position++;
+                if(position!=end && (*position=='+' || *position=='-'))
+                    position++;
+                if(position==end || *position<'0' || *position>'9')
+                    error("expected a digit");
+                skip_digits();
+            }
+            boost::string_ref text(begin, static_cast<size_t>(position-begin));
+            //strtod needs a terminated string
+            char number[64];
+            double value;
+            if(text.size()<sizeof(number)) {
+                std::copy(text.begin(), text.end(), number);
+                number[text.size()]='\0';
+                value=std::strtod(number, nullptr);
+            }
+            else
+                value=std::strtod(std::string(text.begin(), text.end()).c_str(), nullptr);
+            handler.number_value(value, text);
+        }
+
+        void skip_digits() {
+            while(position!=end && *position>='0' && *position<='9')
+                position++;
+        }
+
+        boost::string_ref parse_string() {
+            auto begin=++position;
+            while(position!=end && *position!='"' && *position!='\\') {
+                if(static_cast<unsigned char>(*position)<0x20)
+                    error("control character in string");
+                position++;
+            }
+            if(position==end)
+                error("unterminated string");
+            if(*position=='"')
+                return boost::string_ref(begin, static_cast<size_t>(position++-begin));
+
+            buffer.assign(begin, position);
+            while(true) {
+                if(position==end)
+                    error("unterminated string");
+                auto c=*position++;
+                if(c=='"')
+                    return buffer;
+                if(static_cast<unsigned char>(c)<0x20)
+                    error("control character in string");
+                if(c!='\\') {
+                    buffer+=c;
+                    continue;
+                }
+                if(position==end)
+                    error("unterminated string");
+                switch(*position++) {
+                case '"': buffer+='"'; break;
+                case '\\': buffer+='\\'; break;
+                case '/': buffer+='/'; break;
+                case 'b': buffer+='\b'; break;
+                case 'f': buffer+='\f'; break;
+                case 'n': buffer+='\n'; break;
+                case 'r': buffer+='\r'; break;
+                case 't': buffer+='\t'; break;
+                case 'u': {
+                    auto code_point=parse_hex4();
+                    if(code_point>=0xd800 && code_point<0xdc00) {
+                        if(end-position<6 || position[0]!='\\' || position[1]!='u')
+                            error("unpaired surrogate");
+                        position+=2;
+                        auto low=parse_hex4();
+                        if(low<0xdc00 || low>=0xe000)
+                            error("unpaired surrogate");
+                        code_point=0x10000+((code_point-0xd800)<<10)+(low-0xdc00);
+                    }
+                    else if(code_point>=0xdc00 && code_point<0xe000)
+                        error("unpaired surrogate");
+                    append_utf8(code_point);
+                    break;
+                }
+                default:
+                    position--;
+                    error("invalid escape sequence");
+                }
+            }
+        }
+
+        uint32_t parse_hex4() {
+            if(end-position<4)
+                error("invalid \\u escape");
+            uint32_t value=0;
+            for(int c=0;c<4;c++) {
+                auto digit=*position++;
+                value<<=4;
+                if(digit>='0' && digit<='9')
+                    value|=static_cast<uint32_t>(digit-'0');
+                else if(digit>='a' && digit<='f')
+                    value|=static_cast<uint32_t>(digit-'a'+10);
+                else if(digit>='A' && digit<='F')
+                    value|=static_cast<uint32_t>(digit-'A'+10);
+                else
+                    error("invalid \\u escape");
+            }
+            return value;
+        }
+
+        void append_utf8(uint32_t code_point) {
+            if(code_point<0x80)
+                buffer+=static_cast<char>(code_point);
+            else if(code_point<0x800) {
+                buffer+=static_cast<char>(0xc0|(code_point>>6));
+                buffer+=static_cast<char>(0x80|(code_point&0x3f));
+            }
+            else if(code_point<0x10000) {
+                buffer+=static_cast<char>(0xe0|(code_point>>12));
+                buffer+=static_cast<char>(0x80|((code_point>>6)&0x3f));
+                buffer+=static_cast<char>(0x80|(code_point&0x3f));
+            }
+            else {
+                buffer+=static_cast<char>(0xf0|(code_point>>18));
+                buffer+=static_cast<char>(0x80|((code_point>>12)&0x3f));
+                buffer+=static_cast<char>(0x80|((code_point>>6)&0x3f));
+                buffer+=static_cast<char>(0x80|(code_point&0x3f));
+            }
+        }
+    };
+
+    ///A parsed JSON document. Numbers keep their text, so that they can also be read as strings.
+    class JsonValue {
+    public:
+        enum class Type {null, boolean, number, string, array, object};
+
+        JsonValue(): type(Type::null), boolean(false), number(0) {}
+
+        ///Throws std::invalid_argument if input is not valid JSON
+        static JsonValue parse(boost::string_ref input) {
+            JsonValue root;
+            Builder builder(root);
+            JsonReader reader;
+            reader.parse(input, builder);
+            return root;
+        }
+
+        Type type;
+        bool boolean;
+        double number;
+        ///Value of a string, or the text of a number
+        std::string text;
+        std::vector<JsonValue> items;
+        std::vector<std::pair<std::string, JsonValue> > members;
+
+        ///Returns the member named key, or nullptr if there is none or this is not an object
+        const JsonValue *find(boost::string_ref key) const {
+            for(auto &member: members) {
+                if(member.first==key)
+                    return &member.second;
+            }
+            return nullptr;
+        }
+
+        ///Returns the member named key. Throws std::out_of_range if there is none.
+        const JsonValue &at(boost::string_ref key) const {
+            auto value=find(key);
+            if(!value)
+                throw std::out_of_range("no member "+key.to_string());
+            return *value;
+        }
+
+        ///Returns the value of a string or the text of a number. Throws std::invalid_argument for other types.
+        const std::string &as_string() const {
+            if(type!=Type::string && type!=Type::number)
+                throw std::invalid_argument("not a string");
+            return text;
+        }
+
+        ///Returns the value of a number, or of a string containing a number. Throws std::invalid_argument otherwise.
+        double as_number() const {
+            if(type==Type::number)
+                return number;
+            if(type==Type::string) {
+                char *number_end;
+                auto value=std::strtod(text.c_str(), &number_end);
+                if(!text.empty() && *number_end=='\0')
+                    return value;
+            }
+            throw std::invalid_argument("not a number");
+        }
+
+    private:
+        ///Builds the tree from the events of JsonReader
+        class Builder {
+        public:
+            Builder(JsonValue &root): root(root), started(false) {}
+
+            void null_value() {
+                add();
+            }
+            void boolean_value(bool value) {
+                auto &boolean=add();
+                boolean.type=Type::boolean;
+                boolean.boolean=value;
+            }
+            void number_value(double value, boost::string_ref text) {
+                auto &number=add();
+                number.type=Type::number;
+                number.number=value;
+                number.text.assign(text.begin(), text.end());
+            }
+            void string_value(boost::string_ref value) {
+                auto &string=add();
+                string.type=Type::string;
+                string.text.assign(value.begin(), value.end());
+            }
+            void start_object() {
+                auto &object=add();
+                object.type=Type::object;
+                stack.emplace_back(&object);
+            }
+            void key(boost::string_ref name) {
+                stack.back()->members.emplace_back(name.to_string(), JsonValue());
+            }
+            void end_object() {
+                stack.pop_back();
+            }
+            void start_array() {
+                auto &array=add();
+                array.type=Type::array;
+                stack.emplace_back(&array);
+            }
+            void end_array() {
+                stack.pop_back();
+            }
+
+        private:
+            JsonValue &root;
+            bool started;
+            ///Open objects and arrays. Values are only added to the innermost one, so the pointers stay valid.
+            std::vector<JsonValue*> stack;
+
+            ///Returns the place of the next value: the root, the member after the last key, or a new array item
+            JsonValue &add() {
+                if(!started) {
+                    started=true;
+                    return root;
+                }
+                auto &parent=*stack.back();
+                if(parent.type==Type::object)
+                    return parent.members.back().second;
+                parent.items.emplace_back();
+                return parent.items.back();
+            }
+        };
+    };
+
+    ///Appends JSON to a string as it is written, without building a tree. Separators are inserted, and strings escaped.
+    class JsonWriter {
+    public:
+        JsonWriter(std::string &output): output(output), after_key(false) {}
+
+        JsonWriter &start_object() {
+            separate();
+            output+='{';
+            first.emplace_back(true);
+            return *this;
+        }
+        JsonWriter &end_object() {
+            output+='}';
+            first.pop_back();
+            return *this;
+        }
+        JsonWriter &start_array() {
+            separate();
+            output+='[';
+            first.emplace_back(true);
+            return *this;
+        }
+        JsonWriter &end_array() {
+            output+=']';
+            first.pop_back();
+            return *this;
+        }
+
+        JsonWriter &key(boost::string_ref name) {
+            separate();
+            append_string(name);
+            output+=':';
+            after_key=true;
+            return *this;
+        }
+
+        JsonWriter &string_value(boost::string_ref value) {
+            separate();
+            append_string(value);
+            return *this;
+        }
+        JsonWriter &integer_value(long long value) {
+            separate();
+            output+=std::to_string(value);
+            return *this;
+        }
+        JsonWriter &unsigned_value(unsigned long long value) {
+            separate();
+            output+=std::to_string(value);
+            return *this;
+        }
+        ///Infinity and NaN, which JSON cannot represent, are written as null
+        JsonWriter &number_value(double value) {
+            separate();
+            if(!std::isfinite(value)) {
+                output+="null";
+                return *this;
+            }
+            char number[32];
+            output.append(number, static_cast<size_t>(snprintf(number, sizeof(number), "%.17g", value)));
+            return *this;
+        }
+        JsonWriter &boolean_value(bool value) {
+            separate();
+            output+=value?"true":"false";
+            return *this;
+        }
+        JsonWriter &null_value() {
+            separate();
+            output+="null";
+            return *this;
+        }
+
+    private:
+        std::string &output;
+        ///For every open object or array, whether nothing has been written to it yet
+        std::vector<bool> first;
+        bool after_key;
+
+        void separate() {
+            if(after_key) {
+                after_key=false;
+                return;
+            }
+            if(!first.empty()) {
+                if(!first.back())
+                    output+=',';
+                first.back()=false;
+            }
+        }
+
+        void append_string(boost::string_ref value) {
+            static const char hex[]="0123456789abcdef";
+            output+='"';
+            auto begin=value.begin();
+            for(auto it=value.begin();it!=value.end();it++) {
+                auto c=static_cast<unsigned char>(*it);
+                if(c>=0x20 && c!='"' && c!='\\')
+                    continue;
+                output.append(begin, it);
+                begin=it+1;
+                switch(c) {
+                case '"': output+="\\\""; break;
+                case '\\': output+="\\\\"; break;
+                case '\b': output+="\\b"; break;
+                case '\f': output+="\\f"; break;
+                case '\n': output+="\\n"; break;
+                case '\r': output+="\\r"; break;
+                case '\t': output+="\\t"; break;
+                default:
+                    output+="\\u00";
+                    output+=hex[c>>4];
+                    output+=hex[c&0xf];
+                }
+            }
+            output.append(begin, value.end());
+            output+='"';
+        }
+    };
+}
+#endif	/* JSON_HPP */
@@ -0,0 +1,388 @@
+#ifndef QUERY_INDEX_HPP
+#define	QUERY_INDEX_HPP
+
+#include <boost/utility/string_ref.hpp>
+
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
+#include <cctype>
+
+namespace SimpleWeb {
+    ///Search index over queries for autocompletion. Queries are ranked by when they were last added, so recent queries
+    ///come first, and example queries added with add_example() come after all others.
+    ///A trie on the first max_prefix_length characters keeps the best max_results queries of every prefix, so prefix
+    ///searches only walk the typed characters. Fuzzy searches rank queries by the character trigrams they share with the text.
+    ///At most max_queries queries added with add() are kept, the least recently added ones are removed first.
+    class QueryIndex {
+    public:
+        class Match {
+        public:
+            std::string query;
+            ///Description of an example query, empty for others
+            std::string description;
+        };
+
+        QueryIndex(size_t max_queries=10000, size_t max_results=10, size_t max_prefix_length=32): max_queries(std::max<size_t>(max_queries, 1)),
+                max_results(max_results), max_prefix_length(max_prefix_length), clock(0) {
+            nodes.emplace_back();
+        }
+
+        ///Adds query, or moves it in front of all other queries if it has been added before.
+        ///Removes the least recently added query if there are more than max_queries.
+        void add(const std::string &query) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto id=find_or_insert(query);
+            if(entries[id].score>0)
+                recent.erase(entries[id].score);
+            entries[id].score=++clock;
+            recent.emplace(entries[id].score, id);
+            for_each_node(query, [this, id](Node &node) {
+                auto it=std::find(node.top.begin(), node.top.end(), id);
+                if(it!=node.top.end())
+                    node.top.erase(it);
+                node.top.insert(node.top.begin(), id);
+                if(node.top.size()>max_results)
+                    node.top.pop_back();
+            });
+            if(recent.size()>max_queries)
+                remove_oldest();
+        }
+
+        ///Adds an example query, ranked after the queries added with add(). Does nothing if query has been added before.
+        void add_example(const std::string &query, const std::string &description) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(ids.count(query)>0)
+                return;
+            auto id=find_or_insert(query);
+            entries[id].description=description;
+            examples.emplace_back(id);
+            for_each_node(query, [this, id](Node &node) {
+                if(node.top.size()<max_results)
+                    node.top.emplace_back(id);
+            });
+        }
+
+        ///Returns up to max_matches, at most max_results, queries starting with text, best first
+        std::vector<Match> prefix(boost::string_ref text, size_t max_matches) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<uint32_t> ids;
+            prefix_ids(text, std::min(max_matches, max_results), ids);
+            return matches(ids);
+        }
+
+        ///Returns up to max_matches queries sharing the most trigrams with text, ignoring case.
+        ///Texts shorter than a trigram match the queries containing them.
+        std::vector<Match> fuzzy(boost::string_ref text, size_t max_matches) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<uint32_t> ids;
+            fuzzy_ids(text, max_matches, ids);
+            return matches(ids);
+        }
+
+        ///Prefix matches, followed by fuzzy matches if there are less than max_matches
+        std::vector<Match> search(boost::string_ref text, size_t max_matches) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<uint32_t> ids;
+            prefix_ids(text, std::min(max_matches, max_results), ids);
+            if(ids.size()<max_matches) {
+                std::vector<uint32_t> fuzzy;
+                fuzzy_ids(text, max_matches, fuzzy);
+                for(auto id: fuzzy) {
+                    if(ids.size()==max_matches)
+                        break;
+                    if(std::find(ids.begin(), ids.end(), id)==ids.end())
+                        ids.emplace_back(id);
+                }
+            }
+            return matches(ids);
+        }
+
+    private:
+        class Entry {
+        public:
+            Entry(const std::string &query): query(query), score(0), node_position(0) {}
+            std::string query;
+            std::string description;
+            ///Value of clock when the query was last added, 0 for examples
+            uint64_t score;
+            ///The trigrams of the query, sorted, with the position of the entry in their postings
+            std::vector<std::pair<uint32_t, uint32_t> > postings;
+            ///Position of the entry in Node::entries, if the query is at least max_prefix_length long
+            uint32_t node_position;
+        };
+
+        class Node {
+        public:
+            ///Sorted by character
+            std::vector<std::pair<char, uint32_t> > children;
+            ///The best max_results entries below the node, best first
+            std::vector<uint32_t> top;
+            ///All entries below a node at depth max_prefix_length, to search longer prefixes
+            std::vector<uint32_t> entries;
+        };
+
+        static const size_t max_fuzzy_trigrams=12;
+
+        size_t max_queries;
+        size_t max_results;
+        size_t max_prefix_length;
+        uint64_t clock;
+        std::mutex mutex;
+
+        std::vector<Entry> entries;
+        std::unordered_map<std::string, uint32_t> ids;
+        ///The queries added with add() by their score, the least recently added first
+        std::map<uint64_t, uint32_t> recent;
+        ///The example queries in the order they were added
+        std::vector<uint32_t> examples;
+        ///The root is nodes[0]
+        std::vector<Node> nodes;
+        ///Entries and nodes that have been removed, reused by the next ones
+        std::vector<uint32_t> free_entries, free_nodes;
+        ///Entries by the trigrams of their lower case query
+        std::unordered_map<uint32_t, std::vector<uint32_t> > trigrams;
+        ///Trigrams shared with the text of the current fuzzy search, by entry. Reset to 0 after every search.
+        std::vector<uint16_t> shared;
+
+        uint32_t find_or_insert(const std::string &query) {
+            auto it=ids.find(query);
+            if(it!=ids.end())
+                return it->second;
+            uint32_t id;
+            if(!free_entries.empty()) {
+                id=free_entries.back();
+                free_entries.pop_back();
+                entries[id]=Entry(query);
+            }
+            else {
+                id=static_cast<uint32_t>(entries.size());
+                entries.emplace_back(query);
+            }
+            ids.emplace(query, id);
+            for(auto trigram: query_trigrams(query)) {
+                auto &posting=trigrams[trigram];
+                entries[id].postings.emplace_back(trigram, static_cast<uint32_t>(posting.size()));
+                posting.emplace_back(id);
+            }
+
+            uint32_t node=0;
+            for(size_t c=0;c<query.size() && c<max_prefix_length;c++)
+                node=child(node, query[c], true);
+            if(query.size()>=max_prefix_length) {
+                entries[id].node_position=static_cast<uint32_t>(nodes[node].entries.size());
+                nodes[node].entries.emplace_back(id);
+            }
+            return id;
+        }
+
+        ///Returns the child of node for c, or 0 if there is none and insert is not set
+        uint32_t child(uint32_t node, char c, bool insert) {
+            auto &children=nodes[node].children;
+            auto it=std::lower_bound(children.begin(), children.end(), std::make_pair(c, uint32_t(0)));
+            if(it!=children.end() && it->first==c)
+                return it->second;
+            if(!insert)
+                return 0;
+            uint32_t id;
+            if(!free_nodes.empty()) {
+                id=free_nodes.back();
+                free_nodes.pop_back();
+                children.insert(it, std::make_pair(c, id));
+            }
+            else {
+                id=static_cast<uint32_t>(nodes.size());
+                //Inserting may reallocate nodes, so children is not used afterwards
+                children.insert(it, std::make_pair(c, id));
+                nodes.emplace_back();
+            }
+            return id;
+        }
+
+        ///Removes the least recently added query from the trie, its trigrams and the entries, and the trie nodes left
+        ///without queries. An example query that has been added with add() is ranked as an example query again instead.
+        void remove_oldest() {
+            auto id=recent.begin()->second;
+            recent.erase(recent.begin());
+            auto &entry=entries[id];
+            entry.score=0;
+
+            //The nodes on the path of the query, from the root on
+            std::vector<uint32_t> path(1, 0);
+            for(size_t c=0;c<entry.query.size() && c<max_prefix_length;c++)
+                path.emplace_back(child(path.back(), entry.query[c], false));
+            for(size_t depth=0;depth<path.size();depth++) {
+                auto &top=nodes[path[depth]].top;
+                auto it=std::find(top.begin(), top.end(), id);
+                if(it==top.end())
+                    continue;
+                top.erase(it);
+                fill_examples(top, boost::string_ref(entry.query).substr(0, depth));
+            }
+            if(std::find(examples.begin(), examples.end(), id)!=examples.end())
+                return;
+
+            //The last entry of a posting is moved to the position of the removed one, the order of postings does not matter
+            for(auto &trigram_position: entry.postings) {
+                auto posting=trigrams.find(trigram_position.first);
+                auto moved=posting->second.back();
+                posting->second[trigram_position.second]=moved;
+                posting->second.pop_back();
+                if(moved!=id) {
+                    auto &moved_postings=entries[moved].postings;
+                    std::lower_bound(moved_postings.begin(), moved_postings.end(),
+                            std::make_pair(trigram_position.first, uint32_t(0)))->second=trigram_position.second;
+                }
+                if(posting->second.empty())
+                    trigrams.erase(posting);
+            }
+            if(entry.query.size()>=max_prefix_length) {
+                auto &node_entries=nodes[path.back()].entries;
+                auto moved=node_entries.back();
+                node_entries[entry.node_position]=moved;
+                entries[moved].node_position=entry.node_position;
+                node_entries.pop_back();
+            }
+            //A node without queries below it has an empty top, its children have been removed before it
+            for(auto depth=path.size()-1;depth>0 && nodes[path[depth]].top.empty();depth--) {
+                auto &children=nodes[path[depth-1]].children;
+                children.erase(std::lower_bound(children.begin(), children.end(), std::make_pair(entry.query[depth-1], uint32_t(0))));
+                nodes[path[depth]]=Node();
+                free_nodes.emplace_back(path[depth]);
+            }
+            ids.erase(entry.query);
+            entry=Entry(std::string());
+            free_entries.emplace_back(id);
+        }
+
+        ///Fills top, after an entry has been removed from it, with the example queries starting with prefix. Example
+        ///queries come after all others, in the order they were added, so the examples in top are replaced by them.
+        void fill_examples(std::vector<uint32_t> &top, boost::string_ref prefix) {
+            while(!top.empty() && entries[top.back()].score==0)
+                top.pop_back();
+            for(auto id: examples) {
+                if(top.size()>=max_results)
+                    break;
+                if(entries[id].score==0 && boost::string_ref(entries[id].query).starts_with(prefix))
+                    top.emplace_back(id);
+            }
+        }
+
+        ///Calls function with every node on the path of query, from the root on
+        template<class function_type>
+        void for_each_node(const std::string &query, const function_type &function) {
+            uint32_t node=0;
+            function(nodes[node]);
+            for(size_t c=0;c<query.size() && c<max_prefix_length;c++) {
+                node=child(node, query[c], false);
+                function(nodes[node]);
+            }
+        }
+
+        void prefix_ids(boost::string_ref prefix, size_t max_matches, std::vector<uint32_t> &result) {
+            uint32_t node=0;
+            for(size_t c=0;c<prefix.size() && c<max_prefix_length;c++) {
+                node=child(node, prefix[c], false);
+                if(node==0)
+                    return;
+            }
+            if(prefix.size()<=max_prefix_length) {
+                auto &top=nodes[node].top;
+                result.assign(top.begin(), top.begin()+static_cast<std::ptrdiff_t>(std::min(max_matches, top.size())));
+                return;
+            }
+            for(auto id: nodes[node].entries) {
+                if(boost::string_ref(entries[id].query).starts_with(prefix))
+                    result.emplace_back(id);
+            }
+            sort_by_score(result, max_matches);
+        }
+
+        void fuzzy_ids(boost::string_ref text, size_t max_matches, std::vector<uint32_t> &result) {
+            if(text.size()<3) {
+                std::string lower_text(text.begin(), text.end());
+                std::transform(lower_text.begin(), lower_text.end(), lower_text.begin(), lower);
+                for(auto &query_id: ids) {
+                    std::string query=query_id.first;
+                    std::transform(query.begin(), query.end(), query.begin(), lower);
+                    if(query.find(lower_text)!=std::string::npos)
+                        result.emplace_back(query_id.second);
+                }
+                sort_by_score(result, max_matches);
+                return;
+            }
+
+            //Only the rarest trigrams of long texts are counted, the common ones would visit most queries
+            std::vector<const std::vector<uint32_t>*> postings;
+            for(auto trigram: query_trigrams(text)) {
+                auto it=trigrams.find(trigram);
+                if(it!=trigrams.end())
+                    postings.emplace_back(&it->second);
+            }
+            if(postings.size()>max_fuzzy_trigrams) {
+                std::nth_element(postings.begin(), postings.begin()+max_fuzzy_trigrams, postings.end(),
+                        [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {
+                    return a->size()<b->size();
+                });
+                postings.resize(max_fuzzy_trigrams);
+            }
+
+            shared.resize(entries.size());
+            std::vector<uint32_t> candidates;
+            for(auto posting: postings) {
+                for(auto id: *posting) {
+                    if(shared[id]++==0)
+                        candidates.emplace_back(id);
+                }
+            }
+            //Most shared trigrams first, then the best score
+            auto end=candidates.begin()+static_cast<std::ptrdiff_t>(std::min(max_matches, candidates.size()));
+            std::partial_sort(candidates.begin(), end, candidates.end(), [this](uint32_t a, uint32_t b) {
+                if(shared[a]!=shared[b])
+                    return shared[a]>shared[b];
+                return entries[a].score>entries[b].score;
+            });
+            result.assign(candidates.begin(), end);
+            for(auto id: candidates)
+                shared[id]=0;
+        }
+
+        void sort_by_score(std::vector<uint32_t> &ids, size_t max_matches) {
+            auto end=ids.begin()+static_cast<std::ptrdiff_t>(std::min(max_matches, ids.size()));
+            std::partial_sort(ids.begin(), end, ids.end(), [this](uint32_t a, uint32_t b) {
+                return entries[a].score>entries[b].score;
+            });
+            ids.erase(end, ids.end());
+        }
+
+        std::vector<Match> matches(const std::vector<uint32_t> &ids) {
+            std::vector<Match> result;
+            result.reserve(ids.size());
+            for(auto id: ids)
+                result.emplace_back(Match{entries[id].query, entries[id].description});
+            return result;
+        }
+
+        static char lower(char c) {
+            return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+
+        ///The distinct trigrams of the lower case text
+        static std::vector<uint32_t> query_trigrams(boost::string_ref text) {
+            std::vector<uint32_t> result;
+            for(size_t c=0;c+3<=text.size();c++) {
+                result.emplace_back((uint32_t(static_cast<unsigned char>(lower(text[c])))<<16)|
+                                    (uint32_t(static_cast<unsigned char>(lower(text[c+1])))<<8)|
+                                    uint32_t(static_cast<unsigned char>(lower(text[c+2]))));
+            }
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+            return result;
+        }
+    };
+}
+#endif	/* QUERY_INDEX_HPP */
@@ -0,0 +1,214 @@
+#ifndef REQUEST_PARSER_HPP
+#define	REQUEST_PARSER_HPP
+
+#include <boost/utility/string_ref.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <vector>
+#include <utility>
+
+namespace SimpleWeb {
+    ///Header fields as a flat vector of views into the received header, with case-insensitive lookup by name
+    class HeaderFields {
+    public:
+        typedef std::pair<boost::string_ref, boost::string_ref> value_type;
+        typedef std::vector<value_type>::const_iterator const_iterator;
+        typedef const_iterator iterator;
+
+        const_iterator begin() const {
+            return fields.begin();
+        }
+        const_iterator end() const {
+            return fields.end();
+        }
+        size_t size() const {
+            return fields.size();
+        }
+        bool empty() const {
+            return fields.empty();
+        }
+
+        ///Returns the first field named name, or end()
+        const_iterator find(boost::string_ref name) const {
+            for(auto it=fields.begin();it!=fields.end();it++) {
+                if(boost::algorithm::iequals(it->first, name))
+                    return it;
+            }
+            return fields.end();
+        }
+
+        size_t count(boost::string_ref name) const {
+            size_t count=0;
+            for(auto &field: fields) {
+                if(boost::algorithm::iequals(field.first, name))
+                    count++;
+            }
+            return count;
+        }
+
+        void emplace(boost::string_ref name, boost::string_ref value) {
+            fields.emplace_back(name, value);
+        }
+
+        ///Removes all fields, but keeps the allocated memory
+        void clear() {
+            fields.clear();
+        }
+
+    private:
+        std::vector<value_type> fields;
+    };
+
+    ///Incremental HTTP/1.x request header parser. It keeps its state between calls, so a header received
+    ///in several reads is scanned only once, and stores positions instead of pointers, so the receive
+    ///buffer may be reallocated between calls. Parsing does not allocate once the field vector has grown.
+    class RequestParser {
+    public:
+        enum Result {incomplete, complete, error};
+
+        ///Position of a token in the receive buffer
+        class Range {
+        public:
+            size_t begin, end;
+
+            boost::string_ref ref(const char *data) const {
+                return boost::string_ref(data+begin, end-begin);
+            }
+        };
+
+        Range method, path, http_version;
+        std::vector<std::pair<Range, Range> > fields;
+
+        RequestParser() {
+            reset();
+        }
+
+        ///Prepares the parser for the next request, keeping the allocated memory
+        void reset() {
+            state=State::method;
+            position=0;
+            method=path=http_version=name=value=Range{0, 0};
+            fields.clear();
+        }
+
+        ///Continues parsing data, the first size bytes received so far
+        Result parse(const char *data, size_t size) {
+            for(;position<size;position++) {
+                auto c=data[position];
+                switch(state) {
+                case State::method:
+                    if(c==' ') {
+                        if(position==method.begin)
+                            return error;
+                        method.end=position;
+                        path.begin=position+1;
+                        state=State::path;
+                    }
+                    else if(c=='\r' || c=='\n')
+                        return error;
+                    break;
+                case State::path:
+                    if(c==' ') {
+                        if(position==path.begin)
+                            return error;
+                        path.end=position;
+                        http_version.begin=position+1;
+                        state=State::http_version;
+                    }
+                    else if(c=='\r' || c=='\n')
+                        return error;
+                    break;
+                case State::http_version:
+                    if(c=='\r' || c=='\n') {
+                        //The protocol must be HTTP/<version>
+                        if(position-http_version.begin<6 || boost::string_ref(data+http_version.begin, 5)!="HTTP/")
+                            return error;
+                        http_version.begin+=5;
+                        http_version.end=position;
+                        state=c=='\r'?State::request_line_lf:State::field_start;
+                    }
+                    break;
+                case State::request_line_lf:
+                    if(c!='\n')
+                        return error;
+                    state=State::field_start;
+                    break;
+                case State::field_start:
+                    if(c=='\r')
+                        state=State::end_lf;
+                    else if(c=='\n') {
+                        position++;
+                        return complete;
+                    }
+                    else if(c==':' || c==' ' || c=='\t')
+                        return error;
+                    else {
+                        name.begin=position;
+                        state=State::field_name;
+                    }
+                    break;
+                case State::field_name:
+                    if(c==':') {
+                        name.end=position;
+                        value.begin=value.end=position+1;
+                        state=State::field_value_start;
+                    }
+                    else if(c=='\r' || c=='\n')
+                        return error;
+                    break;
+                case State::field_value_start:
+                    if(c==' ' || c=='\t') {
+                        value.begin=value.end=position+1;
+                        break;
+                    }
+                    state=State::field_value;
+                    //Fall through - c is the first character of the value
+                case State::field_value:
+                    if(c=='\r' || c=='\n') {
+                        fields.emplace_back(name, value);
+                        state=c=='\r'?State::field_lf:State::field_start;
+                    }
+                    else if(c!=' ' && c!='\t')
+                        value.end=position+1;
+                    break;
+                case State::field_lf:
+                    if(c!='\n')
+                        return error;
+                    state=State::field_start;
+                    break;
+                case State::end_lf:
+                    if(c!='\n')
+                        return error;
+                    position++;
+                    return complete;
+                }
+            }
+            return incomplete;
+        }
+
+        ///Size of the header including the empty line, valid after parse() returned complete
+        size_t header_size() const {
+            return position;
+        }
+
+        ///Parses a decimal number such as the value of Content-Length. Returns false if value is not a number.
+        static bool parse_number(boost::string_ref value, unsigned long long &number) {
+            if(value.empty() || value.size()>19)
+                return false;
+            number=0;
+            for(auto c: value) {
+                if(c<'0' || c>'9')
+                    return false;
+                number=number*10+static_cast<unsigned long long>(c-'0');
+            }
+            return true;
+        }
+
+    private:
+        enum class State {method, path, http_version, request_line_lf, field_start, field_name, field_value_start, field_value, field_lf, end_lf};
+        State state;
+        size_t position;
+        Range name, value;
+    };
+}
+#endif	/* REQUEST_PARSER_HPP */
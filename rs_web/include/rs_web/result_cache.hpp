@@ -0,0 +1,148 @@
+#ifndef RESULT_CACHE_HPP
+#define	RESULT_CACHE_HPP
+
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <memory>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <mutex>
+
+namespace SimpleWeb {
+    ///Results of expensive computations by key, such as the responses of a slow backend. Results expire time_to_live after
+    ///they have been computed, and the least recently used ones are evicted to keep the cache within max_entries and max_bytes.
+    ///Callers that ask for a key while its result is being computed wait for that computation instead of starting another one.
+    class ResultCache {
+    public:
+        ///Called with the result, or with nullptr if it could not be computed
+        typedef std::function<void(const std::shared_ptr<const std::string>&)> Callback;
+        ///Computes the result of a key and calls done with it, on any thread. Results passed as nullptr are not cached.
+        typedef std::function<void(const Callback &done)> Loader;
+
+        class Statistics {
+        public:
+            size_t hits, misses, coalesced, evictions, entries, bytes;
+        };
+
+        ResultCache(size_t max_entries, size_t max_bytes, std::chrono::steady_clock::duration time_to_live):
+                max_entries(max_entries), max_bytes(max_bytes), time_to_live(time_to_live), bytes(0), hits(0), misses(0), coalesced(0), evictions(0) {}
+
+        ResultCache(const ResultCache&)=delete;
+        ResultCache &operator=(const ResultCache&)=delete;
+
+        ///Calls callback with the result of key: right away if it is cached and has not expired, otherwise when load,
+        ///or a load of key that is already running, is done. callback is then called on the thread that finished the load.
+        void get(const std::string &key, const Loader &load, const Callback &callback) {
+            std::shared_ptr<Load> started;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto it=entries.find(key);
+                if(it!=entries.end()) {
+                    if(std::chrono::steady_clock::now()<it->second->expires) {
+                        lru.splice(lru.begin(), lru, it->second);
+                        auto result=it->second->result;
+                        hits++;
+                        lock.unlock();
+                        callback(result);
+                        return;
+                    }
+                    erase(it);
+                }
+                auto load_it=loads.find(key);
+                if(load_it!=loads.end()) {
+                    load_it->second->callbacks.emplace_back(callback);
+                    coalesced++;
+                    return;
+                }
+                misses++;
+                started=std::make_shared<Load>();
+                started->callbacks.emplace_back(callback);
+                loads.emplace(key, started);
+            }
+            load([this, key, started](const std::shared_ptr<const std::string> &result) {
+                finish(key, started, result);
+            });
+        }
+
+        ///Drops all results. Loads running meanwhile still call their callbacks, but their results are not cached,
+        ///and later calls of get() start new loads.
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            evictions+=lru.size();
+            lru.clear();
+            entries.clear();
+            loads.clear();
+            bytes=0;
+        }
+
+        Statistics statistics() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return Statistics{hits, misses, coalesced, evictions, lru.size(), bytes};
+        }
+
+    private:
+        class Entry {
+        public:
+            std::string key;
+            std::shared_ptr<const std::string> result;
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        ///A running computation and the callbacks waiting for it
+        class Load {
+        public:
+            std::vector<Callback> callbacks;
+        };
+
+        size_t max_entries;
+        size_t max_bytes;
+        std::chrono::steady_clock::duration time_to_live;
+
+        std::mutex mutex;
+        ///Most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+        std::unordered_map<std::string, std::shared_ptr<Load> > loads;
+        ///Size of the cached results, not counting the keys
+        size_t bytes;
+        size_t hits, misses, coalesced, evictions;
+
+        void finish(const std::string &key, const std::shared_ptr<Load> &load, const std::shared_ptr<const std::string> &result) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it=loads.find(key);
+                //Not cached if clear() has been called during the load
+                if(it!=loads.end() && it->second==load) {
+                    loads.erase(it);
+                    if(result && result->size()<=max_bytes && max_entries>0)
+                        insert(key, result);
+                }
+            }
+            //No other thread adds callbacks once the load has been removed from loads
+            for(auto &callback: load->callbacks)
+                callback(result);
+        }
+
+        void insert(const std::string &key, const std::shared_ptr<const std::string> &result) {
+            auto it=entries.find(key);
+            if(it!=entries.end())
+                erase(it);
+            while(!lru.empty() && (lru.size()>=max_entries || bytes+result->size()>max_bytes)) {
+                erase(entries.find(lru.back().key));
+                evictions++;
+            }
+            lru.emplace_front(Entry{key, result, std::chrono::steady_clock::now()+time_to_live});
+            entries.emplace(key, lru.begin());
+            bytes+=result->size();
+        }
+
+        void erase(std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it) {
+            bytes-=it->second->result->size();
+            lru.erase(it->second);
+            entries.erase(it);
+        }
+    };
+}
+#endif	/* RESULT_CACHE_HPP */
@@ -26,16 +26,35 @@ SOFTWARE.
 #ifndef SERVER_HTTP_HPP
 #define	SERVER_HTTP_HPP
 
+#include "request_parser.hpp"
+#include "timer_wheel.hpp"
+#include "websocket.hpp"
+
 #include <boost/asio.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/functional/hash.hpp>
 
 #include <unordered_map>
+#include <map>
+#include <list>
+#include <deque>
 #include <thread>
 #include <functional>
+#include <atomic>
+#include <mutex>
 #include <iostream>
 #include <sstream>
 
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
+
 // Late 2017 TODO: remove the following checks and always use std::regex
 #ifdef USE_BOOST_REGEX
 #include <boost/regex.hpp>
@@ -46,8 +65,114 @@ SOFTWARE.
 #endif
 
 namespace SimpleWeb {
+    ///Keeps released memory blocks for reuse by allocations of the same size, such as the shared_ptr control blocks
+    ///that a connection allocates for every request.
+    class BlockCache {
+    public:
+        ///allocated is incremented for every block that is not served from the cache
+        BlockCache(std::atomic<size_t> &allocated, size_t max_free_blocks): max_free_blocks(max_free_blocks), allocated(allocated) {
+            free_blocks.reserve(max_free_blocks);
+        }
+        ~BlockCache() {
+            for(auto &block: free_blocks)
+                ::operator delete(block.second);
+        }
+
+        void *allocate(size_t size) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(auto it=free_blocks.begin();it!=free_blocks.end();it++) {
+                    if(it->first==size) {
+                        auto block=it->second;
+                        free_blocks.erase(it);
+                        return block;
+                    }
+                }
+            }
+            allocated++;
+            return ::operator new(size);
+        }
+
+        void deallocate(void *block, size_t size) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(free_blocks.size()<max_free_blocks) {
+                    free_blocks.emplace_back(size, block);
+                    return;
+                }
+            }
+            ::operator delete(block);
+        }
+
+    private:
+        size_t max_free_blocks;
+        std::vector<std::pair<size_t, void*> > free_blocks;
+        std::mutex mutex;
+        std::atomic<size_t> &allocated;
+    };
+
+    template<class T>
+    class BlockCacheAllocator {
+    public:
+        typedef T value_type;
+
+        BlockCacheAllocator(const std::shared_ptr<BlockCache> &cache): cache(cache) {}
+        template<class U>
+        BlockCacheAllocator(const BlockCacheAllocator<U> &other): cache(other.cache) {}
+
+        T *allocate(size_t n) {
+            return static_cast<T*>(cache->allocate(n*sizeof(T)));
+        }
+        void deallocate(T *p, size_t n) {
+            cache->deallocate(p, n*sizeof(T));
+        }
+
+        std::shared_ptr<BlockCache> cache;
+    };
+    template<class T, class U>
+    bool operator==(const BlockCacheAllocator<T> &a, const BlockCacheAllocator<U> &b) {
+        return a.cache==b.cache;
+    }
+    template<class T, class U>
+    bool operator!=(const BlockCacheAllocator<T> &a, const BlockCacheAllocator<U> &b) {
+        return a.cache!=b.cache;
+    }
+
     template <class socket_type>
     class ServerBase {
+    protected:
+        ///One event loop: an io_service, the timeouts of its connections and, in sharded mode, its own acceptor.
+        class Loop {
+        public:
+            Loop(const std::shared_ptr<boost::asio::io_service> &io_service): connections(0), requests(0),
+                    requests_allocated(0), responses_allocated(0), blocks_allocated(0), io_service(io_service), tick_timer(*io_service) {}
+
+            ///Counters for statistics(), kept per loop to avoid sharing a cache line between threads
+            std::atomic<size_t> connections, requests, requests_allocated, responses_allocated, blocks_allocated;
+
+            std::shared_ptr<boost::asio::io_service> io_service;
+            std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+
+            ///Timeouts of the connections in seconds, advanced by tick_timer once per second
+            TimerWheel timer_wheel;
+            boost::asio::deadline_timer tick_timer;
+        };
+
+        class Connection;
+
+        ///Part of the output of a response, sent in order without copying it into a streambuf
+        class Segment {
+        public:
+            std::shared_ptr<const void> owner;
+            const char *data;
+            size_t size;
+            ///File descriptor sent with sendfile(2), or -1 if the segment is sent from data
+            int fd;
+            off_t offset;
+            ///Called when the segments before it have been sent, or failed to be sent
+            std::function<void(const boost::system::error_code&)> callback;
+        };
+
     public:
         virtual ~ServerBase() {}
 
@@ -55,14 +180,109 @@ namespace SimpleWeb {
             friend class ServerBase<socket_type>;
 
             boost::asio::streambuf streambuf;
+            ///Data queued with write_shared() or write_file()
+            std::deque<Segment> segments;
 
-            std::shared_ptr<socket_type> socket;
+            std::shared_ptr<Connection> connection;
+            ///Position of the request among the requests on the connection, to send the responses in the same order
+            size_t sequence;
 
-            Response(const std::shared_ptr<socket_type> &socket): std::ostream(&streambuf), socket(socket) {}
+            ///Set if the request allows Transfer-Encoding: chunked, that is from HTTP/1.1 on
+            bool chunked_allowed;
+            ///Set by chunked() if the content is sent in chunks
+            bool chunked_content;
+            ///First segment of the content written since the previous chunk
+            size_t chunk_begin;
+
+            Response(const std::shared_ptr<Connection> &connection): std::ostream(&streambuf), connection(connection), sequence(0),
+                    chunked_allowed(false), chunked_content(false), chunk_begin(0) {}
+
+            ///Prepares the Response for reuse by the next request on the connection
+            void reset() {
+                streambuf.consume(streambuf.size());
+                segments.clear();
+                clear();
+                connection.reset();
+                chunked_content=false;
+                chunk_begin=0;
+            }
+
+            ///Moves what has been written to the stream so far into a segment, to keep it in front of the next segment
+            void cut_streambuf() {
+                if(streambuf.size()>0) {
+                    auto text=std::make_shared<std::string>(boost::asio::buffers_begin(streambuf.data()), boost::asio::buffers_end(streambuf.data()));
+                    streambuf.consume(streambuf.size());
+                    segments.emplace_back(Segment{text, text->data(), text->size(), -1, 0, nullptr});
+                }
+            }
+
+            ///Frames the content written since the previous chunk as a chunk, followed by the last chunk if last is set
+            void cut_chunk(bool last) {
+                static const char crlf[]="\r\n";
+                static const char last_chunk[]="0\r\n\r\n";
+                cut_streambuf();
+                size_t size=0;
+                for(auto it=segments.begin()+static_cast<std::ptrdiff_t>(chunk_begin);it!=segments.end();it++)
+                    size+=it->size;
+                //An empty chunk would end the content
+                if(size>0) {
+                    char line[20];
+                    auto size_line=std::make_shared<std::string>(line, static_cast<size_t>(snprintf(line, sizeof(line), "%zx\r\n", size)));
+                    segments.insert(segments.begin()+static_cast<std::ptrdiff_t>(chunk_begin), Segment{size_line, size_line->data(), size_line->size(), -1, 0, nullptr});
+                    segments.emplace_back(Segment{nullptr, crlf, 2, -1, 0, nullptr});
+                }
+                if(last)
+                    segments.emplace_back(Segment{nullptr, last_chunk, 5, -1, 0, nullptr});
+                chunk_begin=segments.size();
+            }
 
         public:
+            ///Sends the content with Transfer-Encoding: chunked, so that it can be sent while it is produced, without
+            ///knowing its length in advance. Call after writing the status line and header fields, without the empty line
+            ///that ends the header. Everything written afterwards is sent as a chunk by each ServerBase::send(), and the
+            ///rest when the Response is released. HTTP/1.0 clients receive the content unframed, and the connection is closed after it.
+            void chunked() {
+                if(chunked_allowed) {
+                    *this << "Transfer-Encoding: chunked\r\n\r\n";
+                    cut_streambuf();
+                    chunk_begin=segments.size();
+                    chunked_content=true;
+                }
+                else
+                    *this << "Connection: close\r\n\r\n";
+            }
+
+            ///Size of the output that has not been handed to send() yet
             size_t size() {
-                return streambuf.size();
+                size_t size=streambuf.size();
+                for(auto &segment: segments)
+                    size+=segment.size;
+                return size;
+            }
+
+            ///Queue size bytes at data after what has been written so far, without copying them.
+            ///owner must keep data valid until the response has been sent.
+            void write_shared(const std::shared_ptr<const void> &owner, const char *data, size_t size) {
+                if(size==0)
+                    return;
+                cut_streambuf();
+                segments.emplace_back(Segment{owner, data, size, -1, 0, nullptr});
+            }
+
+            ///Queue size bytes of the open file fd, starting at offset, after what has been written so far.
+            ///The bytes are sent with sendfile(2) where available. owner must keep fd open until the response has been sent.
+            void write_file(const std::shared_ptr<const void> &owner, int fd, off_t offset, size_t size) {
+                if(size==0)
+                    return;
+#ifdef __linux__
+                cut_streambuf();
+                segments.emplace_back(Segment{owner, nullptr, size, fd, offset, nullptr});
+#else
+                std::vector<char> buffer(size);
+                ssize_t read_length=pread(fd, buffer.data(), size, offset);
+                if(read_length>0)
+                    std::ostream::write(buffer.data(), read_length);
+#endif
             }
         };
         
@@ -77,6 +297,11 @@ namespace SimpleWeb {
                 ss << rdbuf();
                 return ss.str();
             }
+            ///The unread content without copying it, valid until the content is read or the Request is released
+            boost::string_ref data() {
+                auto buffer=streambuf.data();
+                return boost::string_ref(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
+            }
         private:
             boost::asio::streambuf &streambuf;
             Content(boost::asio::streambuf &streambuf): std::istream(&streambuf), streambuf(streambuf) {}
@@ -84,45 +309,188 @@ namespace SimpleWeb {
         
         class Request {
             friend class ServerBase<socket_type>;
-            
-            //Based on http://www.boost.org/doc/libs/1_60_0/doc/html/unordered/hash_equality.html
-            class iequal_to {
-            public:
-              bool operator()(const std::string &key1, const std::string &key2) const {
-                return boost::algorithm::iequals(key1, key2);
-              }
-            };
-            class ihash {
-            public:
-              size_t operator()(const std::string &key) const {
-                std::size_t seed=0;
-                for(auto &c: key)
-                  boost::hash_combine(seed, std::tolower(c));
-                return seed;
-              }
-            };
         public:
-            std::string method, path, http_version;
+            ///method, path, http_version and header refer to the received header, which is kept as long as the Request
+            boost::string_ref method, path, http_version;
 
             Content content;
 
-            std::unordered_multimap<std::string, std::string, ihash, iequal_to> header;
+            HeaderFields header;
 
-            REGEX_NS::smatch path_match;
+            REGEX_NS::cmatch path_match;
             
             std::string remote_endpoint_address;
             unsigned short remote_endpoint_port;
             
         private:
-            Request(): content(streambuf) {}
+            Request(): content(streambuf), header_buffer(1024), received(0) {}
             
             boost::asio::streambuf streambuf;
+
+            ///Receive buffer of the header. Bytes received beyond the header are moved to streambuf.
+            std::vector<char> header_buffer;
+            size_t received;
+            RequestParser parser;
+
+            ///Prepares the Request for reuse by the next request on the connection, keeping the allocated buffers
+            void reset() {
+                method=path=http_version=boost::string_ref();
+                header.clear();
+                path_match=REGEX_NS::cmatch();
+                streambuf.consume(streambuf.size());
+                content.clear();
+                received=0;
+                parser.reset();
+            }
+
+            ///Sets method, path, http_version and header after the parser has completed
+            void set_header() {
+                auto data=header_buffer.data();
+                method=parser.method.ref(data);
+                path=parser.path.ref(data);
+                http_version=parser.http_version.ref(data);
+                header.clear();
+                for(auto &field: parser.fields)
+                    header.emplace(field.first.ref(data), field.second.ref(data));
+            }
         };
-        
+
+        ///A connection upgraded to the WebSocket protocol by a request to one of the endpoints in websocket.
+        ///Messages can be sent from any thread, and are sent in order after the 101 response of the upgrade.
+        ///The callbacks of the endpoint are called on the thread of the connection.
+        class WebSocket {
+            friend class ServerBase<socket_type>;
+        public:
+            class Message {
+            public:
+                ///WebSocketProtocol::text or WebSocketProtocol::binary
+                unsigned char opcode;
+                std::string data;
+            };
+
+            ///Path of the upgrade request and its match with the endpoint's regex
+            std::string path;
+            REGEX_NS::smatch path_match;
+
+            std::string remote_endpoint_address;
+            unsigned short remote_endpoint_port;
+
+            ///Set if the client accepted permessage-deflate. send() then compresses messages where that helps.
+            bool deflate() const {
+                return compress;
+            }
+
+            ///Sends a whole text or binary message. callback is called when it has been sent, or could not be sent.
+            void send(boost::string_ref data, unsigned char opcode=WebSocketProtocol::text,
+                      const std::function<void(const boost::system::error_code&)> &callback=nullptr) {
+                send_frame(std::make_shared<std::string>(WebSocketProtocol::message_frame(opcode, data, compress)), callback);
+            }
+
+            ///Sends a frame made with WebSocketProtocol::message_frame() without copying it, so that the same frame can be
+            ///sent to several connections. Compressed frames must only be sent to connections where deflate() is set.
+            void send_frame(const std::shared_ptr<const std::string> &frame, const std::function<void(const boost::system::error_code&)> &callback=nullptr) {
+                boost::system::error_code ec;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if(close_sent)
+                        ec=boost::asio::error::operation_aborted;
+                    else
+                        ec=server.queue_segment(connection, sequence, Segment{frame, frame->data(), frame->size(), -1, 0, callback});
+                }
+                if(ec) {
+                    if(callback)
+                        callback(ec);
+                    return;
+                }
+                server.dispatch_write(connection);
+            }
+
+            ///Starts the closing handshake. The connection is closed when the client has answered, or after the request timeout.
+            ///status 0 sends a close frame without status.
+            void send_close(int status, const std::string &reason=std::string()) {
+                std::string payload;
+                if(status!=0) {
+                    payload+=static_cast<char>((status>>8)&0xff);
+                    payload+=static_cast<char>(status&0xff);
+                    payload+=reason.substr(0, 123);
+                }
+                auto frame=std::make_shared<std::string>();
+                WebSocketProtocol::write_header(*frame, 0x80|WebSocketProtocol::close, payload.size());
+                *frame+=payload;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if(close_sent)
+                        return;
+                    close_sent=true;
+                    if(server.queue_segment(connection, sequence, Segment{frame, frame->data(), frame->size(), -1, 0, nullptr}))
+                        return;
+                }
+                auto server=&this->server;
+                auto connection=this->connection;
+                connection->loop.io_service->dispatch([server, connection] {
+                    server->set_close_timeout(connection);
+                    server->write(connection);
+                });
+            }
+
+            ///See ServerBase::writable() and ServerBase::on_writable(). Frames are buffered like responses.
+            bool writable() {
+                return server.writable(connection);
+            }
+            void on_writable(const std::function<void()> &handler) {
+                server.on_writable(connection, handler);
+            }
+
+        private:
+            WebSocket(ServerBase<socket_type> &server, const std::shared_ptr<Response> &response): server(server), connection(response->connection),
+                    sequence(response->sequence), response(response), compress(false), close_sent(false), closed(false),
+                    buffer(4096), received(0), message_opcode(0), message_compressed(false),
+                    ping_timer(*connection->loop.io_service), received_since_ping(true) {}
+
+            ServerBase<socket_type> &server;
+            std::shared_ptr<Connection> connection;
+            size_t sequence;
+            ///The 101 response. Its exchange receives the frames, and releasing it closes the connection.
+            std::shared_ptr<Response> response;
+            bool compress;
+            WebSocketDeflate::Inflater inflater;
+
+            ///Protects the members below, which are also used by send() on other threads
+            std::mutex mutex;
+            bool close_sent;
+            ///Set when the connection is closing, and the endpoint's on_close has been called
+            bool closed;
+
+            ///Receive buffer, holding at least one whole frame. Only used on the thread of the connection.
+            std::vector<char> buffer;
+            size_t received;
+            ///Data of the fragmented message being received, message_opcode is 0 if there is none
+            std::string message_data;
+            unsigned char message_opcode;
+            bool message_compressed;
+
+            ///Pings the client while the connection is open. Only used on the thread of the connection.
+            boost::asio::deadline_timer ping_timer;
+            bool received_since_ping;
+        };
+
+        class WebSocketEndpoint {
+        public:
+            std::function<void(std::shared_ptr<WebSocket>)> on_open;
+            std::function<void(std::shared_ptr<WebSocket>, std::shared_ptr<typename WebSocket::Message>)> on_message;
+            ///Called once the connection is closing, with the status of the client's close frame, 1005 if it had none,
+            ///or 1006 if the connection was lost
+            std::function<void(std::shared_ptr<WebSocket>, int status, const std::string &reason)> on_close;
+            ///Called when the connection is lost, before on_close
+            std::function<void(std::shared_ptr<WebSocket>, const boost::system::error_code&)> on_error;
+        };
+
         class Config {
             friend class ServerBase<socket_type>;
 
-            Config(unsigned short port, size_t num_threads): num_threads(num_threads), port(port), reuse_address(true) {}
+            Config(unsigned short port, size_t num_threads): num_threads(num_threads), port(port), reuse_address(true),
+                    sharded(false), cpu_affinity(false), max_request_header_size(64*1024), timeout_idle(60), max_pipelined_requests(16),
+                    output_high_watermark(1024*1024), output_low_watermark(256*1024), max_websocket_message_size(16*1024*1024) {}
             size_t num_threads;
         public:
             unsigned short port;
@@ -131,76 +499,263 @@ namespace SimpleWeb {
             std::string address;
             ///Set to false to avoid binding the socket to an address that is already in use.
             bool reuse_address;
+            ///Set to true to run num_threads independent event loops instead of num_threads threads on one io_service.
+            ///Each loop has its own acceptor bound with SO_REUSEPORT, so a connection is always handled by the same thread.
+            bool sharded;
+            ///Set to true to pin the thread of loop n to CPU core n. Only used when sharded is true.
+            bool cpu_affinity;
+            ///Connections sending a larger request header are closed.
+            size_t max_request_header_size;
+            ///Seconds a keep-alive connection may wait for the first byte of its next request. 0 for no limit.
+            ///WebSocket connections are pinged every half of it, and closed if nothing was received for as long.
+            long timeout_idle;
+            ///Requests on a connection that may wait for their responses before the server stops reading further pipelined requests.
+            size_t max_pipelined_requests;
+            ///Bytes handed to a connection with send() or by releasing responses, and not sent yet, above which
+            ///ServerBase::writable() returns false, and below which on_writable() handlers are called.
+            ///File segments are not counted, since they are sent from the page cache.
+            size_t output_high_watermark, output_low_watermark;
+            ///WebSocket connections receiving a larger message, also after decompression, are closed with status 1009.
+            size_t max_websocket_message_size;
         };
         ///Set before calling start().
         Config config;
+
+        ///Counters summed over all loops. In steady state with keep-alive connections, the allocation counters only
+        ///grow with new connections, not with requests.
+        class Statistics {
+        public:
+            size_t connections;
+            size_t requests;
+            ///Request and Response objects that could not be reused from a previous request on the same connection
+            size_t requests_allocated, responses_allocated;
+            ///shared_ptr control blocks of requests and responses that could not be reused
+            size_t blocks_allocated;
+        };
+
+        Statistics statistics() const {
+            Statistics statistics={0, 0, 0, 0, 0};
+            for(auto &loop: loops) {
+                statistics.connections+=loop->connections;
+                statistics.requests+=loop->requests;
+                statistics.requests_allocated+=loop->requests_allocated;
+                statistics.responses_allocated+=loop->responses_allocated;
+                statistics.blocks_allocated+=loop->blocks_allocated;
+            }
+            return statistics;
+        }
         
+        ///Resources by path regex and method. Paths without regex syntax, like "^/info$", are matched by a hash lookup
+        ///and leave Request::path_match empty. The others are only matched against paths starting with their literal prefix.
         std::unordered_map<std::string, std::unordered_map<std::string, 
             std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > >  resource;
         
         std::unordered_map<std::string, 
             std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > default_resource;
         
+        ///WebSocket endpoints by path regex. GET requests with Upgrade: websocket to a matching path are upgraded,
+        ///other requests are passed to resource.
+        std::unordered_map<std::string, WebSocketEndpoint> websocket;
+
         std::function<void(const std::exception&)> exception_handler;
 
     private:
-        std::vector<std::pair<std::string, std::vector<std::pair<REGEX_NS::regex,
-            std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > > > > opt_resource;
+        typedef std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> resource_function;
+
+        ///The resources of one method, compiled for lookups in O(path length) independent of the number of resources
+        class Routes {
+        public:
+            class RegexRoute {
+            public:
+                RegexRoute(const std::string &pattern, const resource_function &function): regex(pattern), function(function) {}
+                REGEX_NS::regex regex;
+                resource_function function;
+            };
+
+            ///Trie on the literal prefixes of the regex routes
+            class Node {
+            public:
+                std::map<char, std::unique_ptr<Node> > children;
+                std::vector<RegexRoute> routes;
+            };
+
+            class string_ref_hash {
+            public:
+                size_t operator()(boost::string_ref key) const {
+                    return boost::hash_range(key.begin(), key.end());
+                }
+            };
+
+            ///Literal paths, referred to by the keys of literal_routes
+            std::list<std::string> literal_paths;
+            std::unordered_map<boost::string_ref, resource_function, string_ref_hash> literal_routes;
+            Node regex_routes;
+
+            void add(const std::string &pattern, const resource_function &function) {
+                bool literal;
+                auto prefix=literal_prefix(pattern, literal);
+                if(literal) {
+                    literal_paths.emplace_back(prefix);
+                    literal_routes.emplace(literal_paths.back(), function);
+                    return;
+                }
+                auto node=&regex_routes;
+                for(auto c: prefix) {
+                    auto &child=node->children[c];
+                    if(!child)
+                        child=std::unique_ptr<Node>(new Node());
+                    node=child.get();
+                }
+                node->routes.emplace_back(pattern, function);
+            }
+
+            ///Returns the resource for path, or nullptr. Regex routes with longer literal prefixes are tried first.
+            resource_function *find(boost::string_ref path, REGEX_NS::cmatch &path_match) {
+                auto it=literal_routes.find(path);
+                if(it!=literal_routes.end())
+                    return &it->second;
+
+                std::vector<Node*> nodes;
+                auto node=&regex_routes;
+                for(size_t c=0;;c++) {
+                    if(!node->routes.empty())
+                        nodes.emplace_back(node);
+                    if(c==path.size())
+                        break;
+                    auto child=node->children.find(path[c]);
+                    if(child==node->children.end())
+                        break;
+                    node=child->second.get();
+                }
+                for(auto node_it=nodes.rbegin();node_it!=nodes.rend();node_it++) {
+                    for(auto &route: (*node_it)->routes) {
+                        if(REGEX_NS::regex_match(path.begin(), path.end(), path_match, route.regex))
+                            return &route.function;
+                    }
+                }
+                return nullptr;
+            }
+
+            ///Returns the characters every path matching pattern starts with. literal is set to true
+            ///if pattern matches exactly that string.
+            static std::string literal_prefix(const std::string &pattern, bool &literal) {
+                std::string prefix;
+                literal=false;
+                //Top-level alternatives have no common prefix
+                if(pattern.find('|')!=std::string::npos)
+                    return prefix;
+                size_t c=0;
+                if(c<pattern.size() && pattern[c]=='^')
+                    c++;
+                for(;c<pattern.size();c++) {
+                    auto ch=pattern[c];
+                    if(ch=='\\' && c+1<pattern.size() && std::string(".^$|()[]{}*+?\\/-").find(pattern[c+1])!=std::string::npos) {
+                        //Escaped character, unless it is followed by a quantifier
+                        if(c+2<pattern.size() && std::string("*+?{").find(pattern[c+2])!=std::string::npos)
+                            return prefix;
+                        prefix+=pattern[++c];
+                    }
+                    else if(ch=='$' && c+1==pattern.size()) {
+                        literal=true;
+                        return prefix;
+                    }
+                    else if(std::string(".^$|()[]{}*+?\\").find(ch)!=std::string::npos) {
+                        //A quantifier also applies to the previous character
+                        if(!prefix.empty() && std::string("*+?{").find(ch)!=std::string::npos)
+                            prefix.pop_back();
+                        return prefix;
+                    }
+                    else if(c+1<pattern.size() && std::string("*+?{").find(pattern[c+1])!=std::string::npos)
+                        return prefix;
+                    else
+                        prefix+=ch;
+                }
+                //regex_match() matches the whole path, so a trailing $ is optional
+                literal=true;
+                return prefix;
+            }
+        };
+
+        ///Routes by method. There are only a few methods, so they are searched linearly.
+        std::vector<std::pair<std::string, Routes> > opt_resource;
+        std::vector<std::pair<REGEX_NS::regex, WebSocketEndpoint*> > opt_websocket;
         
     public:
         void start() {
-            //Copy the resources to opt_resource for more efficient request processing
+            //Compile the resources to opt_resource for more efficient request processing
             opt_resource.clear();
             for(auto& res: resource) {
                 for(auto& res_method: res.second) {
-                    auto it=opt_resource.end();
-                    for(auto opt_it=opt_resource.begin();opt_it!=opt_resource.end();opt_it++) {
-                        if(res_method.first==opt_it->first) {
-                            it=opt_it;
-                            break;
-                        }
-                    }
+                    auto it=opt_resource.begin();
+                    while(it!=opt_resource.end() && it->first!=res_method.first)
+                        it++;
                     if(it==opt_resource.end()) {
-                        opt_resource.emplace_back();
+                        opt_resource.emplace_back(res_method.first, Routes());
                         it=opt_resource.begin()+(opt_resource.size()-1);
-                        it->first=res_method.first;
                     }
-                    it->second.emplace_back(REGEX_NS::regex(res.first), res_method.second);
+                    it->second.add(res.first, res_method.second);
                 }
             }
+            opt_websocket.clear();
+            for(auto &endpoint: websocket)
+                opt_websocket.emplace_back(REGEX_NS::regex(endpoint.first), &endpoint.second);
 
             if(!io_service)
                 io_service=std::make_shared<boost::asio::io_service>();
 
-            if(io_service->stopped())
-                io_service->reset();
-
             boost::asio::ip::tcp::endpoint endpoint;
             if(config.address.size()>0)
                 endpoint=boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(config.address), config.port);
             else
                 endpoint=boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), config.port);
-            
-            if(!acceptor)
-                acceptor=std::unique_ptr<boost::asio::ip::tcp::acceptor>(new boost::asio::ip::tcp::acceptor(*io_service));
-            acceptor->open(endpoint.protocol());
-            acceptor->set_option(boost::asio::socket_base::reuse_address(config.reuse_address));
-            acceptor->bind(endpoint);
-            acceptor->listen();
-     
-            accept(); 
-            
-            //If num_threads>1, start m_io_service.run() in (num_threads-1) threads for thread-pooling
+
+            //In sharded mode every thread gets its own loop, otherwise all threads share the loop of io_service
+            size_t num_loops=(config.sharded && config.num_threads>1)?config.num_threads:1;
+            loops.resize(num_loops);
+            for(size_t c=0;c<num_loops;c++) {
+                if(!loops[c])
+                    loops[c]=std::unique_ptr<Loop>(new Loop(c==0?io_service:std::make_shared<boost::asio::io_service>()));
+                auto &loop=*loops[c];
+                if(loop.io_service->stopped())
+                    loop.io_service->reset();
+
+                if(!loop.acceptor)
+                    loop.acceptor=std::unique_ptr<boost::asio::ip::tcp::acceptor>(new boost::asio::ip::tcp::acceptor(*loop.io_service));
+                loop.acceptor->open(endpoint.protocol());
+                loop.acceptor->set_option(boost::asio::socket_base::reuse_address(config.reuse_address));
+                if(num_loops>1) {
+#ifdef SO_REUSEPORT
+                    loop.acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+                    throw std::runtime_error("sharded server requires SO_REUSEPORT");
+#endif
+                }
+                loop.acceptor->bind(endpoint);
+                loop.acceptor->listen();
+
+                accept(loop);
+
+                loop.tick_timer.expires_from_now(boost::posix_time::seconds(0));
+                tick(loop);
+            }
+
+            //Start (num_threads-1) threads, each running its own loop when sharded, else all running io_service for thread-pooling
             threads.clear();
             for(size_t c=1;c<config.num_threads;c++) {
-                threads.emplace_back([this](){
-                    io_service->run();
+                auto &loop=*loops[num_loops>1?c:0];
+                threads.emplace_back([&loop](){
+                    loop.io_service->run();
                 });
+                if(num_loops>1 && config.cpu_affinity)
+                    set_cpu_affinity(threads.back().native_handle(), c);
             }
 
             //Main thread
-            if(config.num_threads>0)
+            if(config.num_threads>0) {
+                if(num_loops>1 && config.cpu_affinity)
+                    set_cpu_affinity(pthread_self(), 0);
                 io_service->run();
+            }
 
             //Wait for the rest of the threads, if any, to finish as well
             for(auto& t: threads) {
@@ -209,16 +764,46 @@ namespace SimpleWeb {
         }
         
         void stop() {
-            acceptor->close();
-            if(config.num_threads>0)
-                io_service->stop();
+            for(auto& loop: loops) {
+                loop->acceptor->close();
+                boost::system::error_code ec;
+                loop->tick_timer.cancel(ec);
+                if(config.num_threads>0)
+                    loop->io_service->stop();
+            }
         }
         
-        ///Use this function if you need to recursively send parts of a longer message
-        void send(const std::shared_ptr<Response> &response, const std::function<void(const boost::system::error_code&)>& callback=nullptr) const {
-            boost::asio::async_write(*response->socket, response->streambuf, [this, response, callback](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
-                if(callback)
-                    callback(ec);
+        ///Use this function if you need to recursively send parts of a longer message.
+        ///Responses to pipelined requests are sent in the order of the requests, so callback is only called
+        ///after the responses to the earlier requests on the connection have been sent.
+        void send(const std::shared_ptr<Response> &response, const std::function<void(const boost::system::error_code&)>& callback=nullptr) {
+            response->cut_streambuf();
+            queue_output(response, callback, false);
+        }
+
+        ///Returns false while the output buffered for the connection of response is above config.output_high_watermark,
+        ///or if sending has failed. Handlers producing large responses should then stop writing until on_writable() calls them back.
+        bool writable(const std::shared_ptr<Response> &response) {
+            return writable(response->connection);
+        }
+
+        ///Calls handler once the output buffered for the connection of response has been sent down to
+        ///config.output_low_watermark, or right away if it is below already. If sending fails, handler is dropped without being called.
+        void on_writable(const std::shared_ptr<Response> &response, const std::function<void()> &handler) {
+            on_writable(response->connection, handler);
+        }
+
+        ///Sends a response while its content is produced. write is called with the response, writes the next part of the
+        ///content to it, and returns false after the last part. Parts are produced while the connection is writable(),
+        ///so a slow client slows down the producer instead of the content piling up in memory. Use with Response::chunked().
+        void stream(const std::shared_ptr<Response> &response, const std::function<bool(Response&)> &write) {
+            while(writable(response)) {
+                if(!write(*response))
+                    return;
+                send(response);
+            }
+            on_writable(response, [this, response, write] {
+                stream(response, write);
             });
         }
 
@@ -226,7 +811,139 @@ namespace SimpleWeb {
         /// You might also want to set config.num_threads to 0.
         std::shared_ptr<boost::asio::io_service> io_service;
     protected:
-        std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+        bool writable(const std::shared_ptr<Connection> &connection) {
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            return !connection->write_error && connection->buffered<=config.output_high_watermark;
+        }
+
+        void on_writable(const std::shared_ptr<Connection> &connection, const std::function<void()> &handler) {
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                if(connection->write_error)
+                    return;
+                if(connection->buffered>config.output_low_watermark) {
+                    connection->writable_handlers.emplace_back(handler);
+                    return;
+                }
+            }
+            handler();
+        }
+
+        ///A client connection. All of its handlers run on the io_service of its loop. The Requests, Responses
+        ///and control blocks of the exchanges are reused by the following exchanges on the connection.
+        ///max_pipelined_requests is the number of exchanges that can be in progress at the same time.
+        ///The connection is a node of its loop's timer wheel, rearmed for every read or write phase.
+        class Connection : public TimerWheel::Node {
+        public:
+            Connection(std::unique_ptr<socket_type> &&socket, Loop &loop, size_t max_pipelined_requests): socket(std::move(socket)), loop(loop),
+                    max_free(max_pipelined_requests+1), blocks(std::make_shared<BlockCache>(loop.blocks_allocated, 4*max_free)),
+                    exchanges_begin(0), exchanges_end(0), writing(false), corked(false), read_paused(false), read_timeout(0),
+                    upgraded(false), buffered(0) {
+                free_requests.reserve(max_free);
+                free_responses.reserve(max_free);
+            }
+            ~Connection() {
+                loop.timer_wheel.disarm(*this);
+            }
+
+            std::unique_ptr<socket_type> socket;
+            Loop &loop;
+            ///Used by the timer wheel to find out if the connection still exists
+            std::weak_ptr<Connection> self;
+
+            ///Number of released requests and responses kept for reuse
+            size_t max_free;
+            std::shared_ptr<BlockCache> blocks;
+            std::vector<std::unique_ptr<Request> > free_requests;
+            std::vector<std::unique_ptr<Response> > free_responses;
+            ///Handlers may release requests and responses on other threads
+            std::mutex free_mutex;
+
+            ///Bytes received after the previous request, the beginning of the next pipelined request
+            std::vector<char> leftover;
+
+            ///Output of one request. The output of a request is sent once the requests before it are complete.
+            class Exchange {
+            public:
+                Exchange(): next(0), complete(false), close(false) {}
+                std::vector<Segment> segments;
+                ///First segment that has not been taken by a write yet
+                size_t next;
+                ///Set when the handler has released the Response
+                bool complete;
+                ///Set if the connection is closed after the response
+                bool close;
+            };
+
+            ///Protects the members below, since handlers may hand over output on other threads
+            std::mutex write_mutex;
+            ///Ring buffer of config.max_pipelined_requests exchanges, the exchange of request n is at n%exchanges.size()
+            std::vector<Exchange> exchanges;
+            ///Numbers of the oldest request that is not completely written yet, and of the next request
+            size_t exchanges_begin, exchanges_end;
+            ///Set while write_segments are written
+            bool writing;
+            ///Set while pipelined requests that have already been received are dispatched, to send their responses together
+            bool corked;
+            ///Set when reading stopped because exchanges is full
+            bool read_paused;
+            ///Timeout of the read in progress, armed once no responses are pending. 0 if not reading.
+            long read_timeout;
+            ///Set when the connection has been upgraded to the WebSocket protocol. Its last exchange then stays pending,
+            ///and only writes and closing handshakes are timed out.
+            bool upgraded;
+            ///Error of a failed write. Output handed over afterwards is dropped.
+            boost::system::error_code write_error;
+            ///Bytes of the memory segments handed over and not sent yet
+            size_t buffered;
+            ///Called when buffered has dropped to config.output_low_watermark
+            std::vector<std::function<void()> > writable_handlers;
+            ///Segments of the write in progress and their buffers, reused by the following writes
+            std::vector<Segment> write_segments;
+            std::vector<boost::asio::const_buffer> write_buffers;
+        };
+
+        ///Buffer sequence referring to Connection::write_buffers, so that writes do not copy the vector
+        class WriteBuffers {
+        public:
+            typedef boost::asio::const_buffer value_type;
+            typedef std::vector<boost::asio::const_buffer>::const_iterator const_iterator;
+            const std::vector<boost::asio::const_buffer> *buffers;
+            const_iterator begin() const {
+                return buffers->begin();
+            }
+            const_iterator end() const {
+                return buffers->end();
+            }
+        };
+
+        ///Deleters returning requests and responses to their connection
+        class RequestRecycler {
+        public:
+            std::shared_ptr<Connection> connection;
+            void operator()(Request *request) const {
+                request->reset();
+                std::lock_guard<std::mutex> lock(connection->free_mutex);
+                if(connection->free_requests.size()<connection->max_free)
+                    connection->free_requests.emplace_back(request);
+                else
+                    delete request;
+            }
+        };
+        class ResponseRecycler {
+        public:
+            std::shared_ptr<Connection> connection;
+            void operator()(Response *response) const {
+                response->reset();
+                std::lock_guard<std::mutex> lock(connection->free_mutex);
+                if(connection->free_responses.size()<connection->max_free)
+                    connection->free_responses.emplace_back(response);
+                else
+                    delete response;
+            }
+        };
+
+        std::vector<std::unique_ptr<Loop> > loops;
         std::vector<std::thread> threads;
         
         long timeout_request;
@@ -235,28 +952,352 @@ namespace SimpleWeb {
         ServerBase(unsigned short port, size_t num_threads, long timeout_request, long timeout_send_or_receive) :
                 config(port, num_threads), timeout_request(timeout_request), timeout_content(timeout_send_or_receive) {}
         
-        virtual void accept()=0;
+        virtual void accept(Loop &loop)=0;
+
+        static void set_cpu_affinity(std::thread::native_handle_type thread, size_t cpu) {
+#ifdef __linux__
+            auto num_cpus=std::thread::hardware_concurrency();
+            if(num_cpus==0)
+                return;
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(cpu%num_cpus, &cpu_set);
+            pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpu_set);
+#else
+            (void)thread;
+            (void)cpu;
+#endif
+        }
+        
+        ///Hands the output written to response so far over to its connection, followed by callback.
+        ///complete is set when the handler has released response, which is then kept until its streambuf has been sent.
+        void queue_output(const std::shared_ptr<Response> &response, const std::function<void(const boost::system::error_code&)>& callback, bool complete) {
+            auto connection=response->connection;
+            if(response->chunked_content)
+                response->cut_chunk(complete);
+            boost::system::error_code write_error;
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                write_error=connection->write_error;
+                if(!write_error) {
+                    auto &exchange=connection->exchanges[response->sequence%connection->exchanges.size()];
+                    for(auto &segment: response->segments) {
+                        if(segment.fd<0)
+                            connection->buffered+=segment.size;
+                        exchange.segments.emplace_back(std::move(segment));
+                    }
+                    if(complete && response->streambuf.size()>0) {
+                        exchange.segments.emplace_back(Segment{response, boost::asio::buffer_cast<const char*>(response->streambuf.data()),
+                                response->streambuf.size(), -1, 0, nullptr});
+                        connection->buffered+=response->streambuf.size();
+                    }
+                    if(callback)
+                        exchange.segments.emplace_back(Segment{nullptr, nullptr, 0, -1, 0, callback});
+                    exchange.complete=complete;
+                }
+                response->segments.clear();
+                response->chunk_begin=0;
+            }
+            if(write_error) {
+                if(callback)
+                    callback(write_error);
+                return;
+            }
+            dispatch_write(connection);
+        }
+
+        ///Hands segment over to exchange sequence of connection, after the output handed over before.
+        ///Returns the error of a failed write, and drops segment then.
+        boost::system::error_code queue_segment(const std::shared_ptr<Connection> &connection, size_t sequence, Segment &&segment) {
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            if(connection->write_error)
+                return connection->write_error;
+            connection->buffered+=segment.size;
+            connection->exchanges[sequence%connection->exchanges.size()].segments.emplace_back(std::move(segment));
+            return boost::system::error_code();
+        }
+
+        ///Calls write() on the loop of connection: right away if called from it, else posted to it, since handlers
+        ///and publishers may hand output over on other threads, and the socket and timer wheel belong to the loop.
+        void dispatch_write(const std::shared_ptr<Connection> &connection) {
+            connection->loop.io_service->dispatch([this, connection] {
+                write(connection);
+            });
+        }
+
+        ///Writes the output handed over to connection in the order of the requests. Consecutive memory segments,
+        ///also of different responses, are sent with one gather write, file segments with sendfile(2).
+        void write(const std::shared_ptr<Connection> &connection) {
+            auto &segments=connection->write_segments;
+            bool close=false;
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                if(connection->writing || connection->corked || connection->write_error)
+                    return;
+                auto &exchanges=connection->exchanges;
+                auto begin=connection->exchanges_begin;
+                bool stop=false;
+                while(!stop && connection->exchanges_begin!=connection->exchanges_end) {
+                    auto &exchange=exchanges[connection->exchanges_begin%exchanges.size()];
+                    while(exchange.next<exchange.segments.size()) {
+                        //A file segment is sent on its own
+                        if(exchange.segments[exchange.next].fd>=0 && !segments.empty()) {
+                            stop=true;
+                            break;
+                        }
+                        segments.emplace_back(std::move(exchange.segments[exchange.next++]));
+                        if(segments.back().fd>=0) {
+                            stop=true;
+                            break;
+                        }
+                    }
+                    if(exchange.next==exchange.segments.size()) {
+                        exchange.segments.clear();
+                        exchange.next=0;
+                    }
+                    if(exchange.next>0 || !exchange.complete)
+                        break;
+                    exchange.complete=false;
+                    connection->exchanges_begin++;
+                    if(exchange.close) {
+                        close=true;
+                        break;
+                    }
+                }
+                if(segments.empty() && connection->exchanges_begin==begin)
+                    return;
+                connection->writing=true;
+                if(connection->upgraded)
+                    set_timeout(connection, timeout_content);
+            }
+
+            if(!segments.empty() && segments.front().fd>=0) {
+                send_file_segment(connection, close);
+                return;
+            }
+            auto &buffers=connection->write_buffers;
+            buffers.clear();
+            for(auto &segment: segments) {
+                if(segment.size>0)
+                    buffers.emplace_back(segment.data, segment.size);
+            }
+            if(buffers.empty()) {
+                written(connection, boost::system::error_code(), close);
+                return;
+            }
+            boost::asio::async_write(*connection->socket, WriteBuffers{&buffers}, [this, connection, close](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
+                written(connection, ec, close);
+            });
+        }
+
+        ///Completes a write of write_segments, and starts the next one
+        void written(const std::shared_ptr<Connection> &connection, const boost::system::error_code& ec, bool close) {
+            size_t written_size=0;
+            for(auto &segment: connection->write_segments) {
+                if(segment.fd<0)
+                    written_size+=segment.size;
+                if(segment.callback)
+                    segment.callback(ec);
+            }
+            //Returns the completely sent responses to the connection
+            connection->write_segments.clear();
+            if(ec) {
+                fail(connection, ec);
+                return;
+            }
+
+            bool read_next=false;
+            std::vector<std::function<void()> > writable_handlers;
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                connection->writing=false;
+                connection->buffered-=written_size;
+                if(connection->buffered<=config.output_low_watermark)
+                    writable_handlers.swap(connection->writable_handlers);
+                auto pending=connection->exchanges_end-connection->exchanges_begin;
+                set_timeout(connection, (pending>0 && !connection->upgraded)?timeout_content:connection->read_timeout);
+                if(connection->read_paused && pending<connection->exchanges.size()) {
+                    connection->read_paused=false;
+                    read_next=true;
+                }
+            }
+            if(close) {
+                boost::system::error_code ec;
+                connection->socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                return;
+            }
+            if(read_next)
+                read_request_and_content(connection, true);
+            for(auto &handler: writable_handlers)
+                handler();
+            write(connection);
+        }
+
+        ///Starts writing the output held back while pipelined requests were dispatched
+        void uncork(const std::shared_ptr<Connection> &connection) {
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                if(!connection->corked)
+                    return;
+                connection->corked=false;
+            }
+            write(connection);
+        }
+
+        ///Drops the output of connection after a failed write, and closes it
+        void fail(const std::shared_ptr<Connection> &connection, const boost::system::error_code& ec) {
+            std::vector<Segment> dropped;
+            std::vector<std::function<void()> > writable_handlers;
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                connection->write_error=ec;
+                connection->writing=false;
+                connection->buffered=0;
+                writable_handlers.swap(connection->writable_handlers);
+                for(;connection->exchanges_begin!=connection->exchanges_end;connection->exchanges_begin++) {
+                    auto &exchange=connection->exchanges[connection->exchanges_begin%connection->exchanges.size()];
+                    for(;exchange.next<exchange.segments.size();exchange.next++)
+                        dropped.emplace_back(std::move(exchange.segments[exchange.next]));
+                    exchange.segments.clear();
+                    exchange.next=0;
+                    exchange.complete=false;
+                }
+                cancel_timeout(connection);
+            }
+            for(auto &segment: dropped) {
+                if(segment.callback)
+                    segment.callback(ec);
+            }
+            boost::system::error_code close_ec;
+            connection->socket->lowest_layer().close(close_ec);
+        }
+
+        ///Sends the file segment write_segments.front()
+        void send_file_segment(const std::shared_ptr<Connection> &connection, bool close) {
+#ifdef __linux__
+            auto &socket=*connection->socket;
+            auto &segment=connection->write_segments.front();
+            boost::system::error_code ec;
+            if(!socket.native_non_blocking())
+                socket.native_non_blocking(true, ec);
+            while(!ec && segment.size>0) {
+                ssize_t sent=::sendfile(socket.native_handle(), segment.fd, &segment.offset, segment.size);
+                if(sent>0)
+                    segment.size-=static_cast<size_t>(sent);
+                else if(sent<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+                    //Wait until the socket is writable again
+                    socket.async_write_some(boost::asio::null_buffers(), [this, connection, close](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
+                        if(ec)
+                            written(connection, ec, close);
+                        else
+                            send_file_segment(connection, close);
+                    });
+                    return;
+                }
+                else if(sent==0)
+                    ec=boost::asio::error::eof; //The file was truncated
+                else
+                    ec=boost::system::error_code(errno, boost::system::system_category());
+            }
+            written(connection, ec, close);
+#else
+            //write_file() copies into the stream where sendfile(2) is not available
+            (void)connection;
+            (void)close;
+#endif
+        }
         
-        std::shared_ptr<boost::asio::deadline_timer> get_timeout_timer(const std::shared_ptr<socket_type> &socket, long seconds) {
+        ///Closes the connection if the current read or write does not complete within seconds
+        void set_timeout(const std::shared_ptr<Connection> &connection, long seconds) {
             if(seconds==0)
-                return nullptr;
-            
-            auto timer=std::make_shared<boost::asio::deadline_timer>(*io_service);
-            timer->expires_from_now(boost::posix_time::seconds(seconds));
-            timer->async_wait([socket](const boost::system::error_code& ec){
-                if(!ec) {
+                connection->loop.timer_wheel.disarm(*connection);
+            else
+                connection->loop.timer_wheel.arm(*connection, static_cast<uint64_t>(seconds));
+        }
+
+        void cancel_timeout(const std::shared_ptr<Connection> &connection) {
+            connection->loop.timer_wheel.disarm(*connection);
+        }
+
+        ///Sets the timeout of the current read, which only applies while no responses are pending on the connection
+        void set_read_timeout(const std::shared_ptr<Connection> &connection, long seconds) {
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            connection->read_timeout=seconds;
+            if(connection->exchanges_begin==connection->exchanges_end)
+                set_timeout(connection, seconds);
+        }
+
+        ///Closes an upgraded connection if the client does not answer the close frame within timeout_request
+        void set_close_timeout(const std::shared_ptr<Connection> &connection) {
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            connection->read_timeout=timeout_request;
+            if(!connection->writing)
+                set_timeout(connection, timeout_request);
+        }
+
+        ///Advances the timer wheel of loop every second and closes the connections that timed out
+        void tick(Loop &loop) {
+            loop.tick_timer.expires_at(loop.tick_timer.expires_at()+boost::posix_time::seconds(1));
+            loop.tick_timer.async_wait([this, &loop](const boost::system::error_code& ec) {
+                if(ec)
+                    return;
+                std::vector<std::shared_ptr<Connection> > expired;
+                loop.timer_wheel.advance([&expired](TimerWheel::Node &node) {
+                    if(auto connection=static_cast<Connection&>(node).self.lock())
+                        expired.emplace_back(std::move(connection));
+                });
+                for(auto &connection: expired) {
                     boost::system::error_code ec;
-                    socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-                    socket->lowest_layer().close();
+                    connection->socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                    connection->socket->lowest_layer().close(ec);
                 }
+                tick(loop);
             });
-            return timer;
+        }
+
+        ///Returns a Request of a previous exchange on the connection, or a new one
+        std::shared_ptr<Request> make_request(const std::shared_ptr<Connection> &connection) {
+            std::unique_ptr<Request> request;
+            {
+                std::lock_guard<std::mutex> lock(connection->free_mutex);
+                if(!connection->free_requests.empty()) {
+                    request=std::move(connection->free_requests.back());
+                    connection->free_requests.pop_back();
+                }
+            }
+            if(!request) {
+                request=std::unique_ptr<Request>(new Request());
+                connection->loop.requests_allocated++;
+            }
+            connection->loop.requests++;
+            return std::shared_ptr<Request>(request.release(), RequestRecycler{connection}, BlockCacheAllocator<Request>(connection->blocks));
+        }
+
+        ///Returns a Response of a previous exchange on the connection, or a new one, owned by deleter
+        template<class deleter_type>
+        std::shared_ptr<Response> make_response(const std::shared_ptr<Connection> &connection, const deleter_type &deleter) {
+            std::unique_ptr<Response> response;
+            {
+                std::lock_guard<std::mutex> lock(connection->free_mutex);
+                if(!connection->free_responses.empty()) {
+                    response=std::move(connection->free_responses.back());
+                    connection->free_responses.pop_back();
+                }
+            }
+            if(response)
+                response->connection=connection;
+            else {
+                response=std::unique_ptr<Response>(new Response(connection));
+                connection->loop.responses_allocated++;
+            }
+            return std::shared_ptr<Response>(response.release(), deleter, BlockCacheAllocator<Response>(connection->blocks));
         }
         
-        void read_request_and_content(const std::shared_ptr<socket_type> &socket) {
-            //Create new streambuf (Request::streambuf) for async_read_until()
+        ///keep_alive is true if the connection already had a request and is now idle until the next one
+        void read_request_and_content(const std::shared_ptr<Connection> &connection, bool keep_alive=false) {
+            auto &socket=connection->socket;
             //shared_ptr is used to pass temporary objects to the asynchronous functions
-            std::shared_ptr<Request> request(new Request());
+            auto request=make_request(connection);
             try {
                 request->remote_endpoint_address=socket->lowest_layer().remote_endpoint().address().to_string();
                 request->remote_endpoint_port=socket->lowest_layer().remote_endpoint().port();
@@ -266,150 +1307,198 @@ namespace SimpleWeb {
                    exception_handler(e);
             }
 
-            //Set timeout on the following boost::asio::async-read or write function
-            auto timer=get_timeout_timer(socket, timeout_request);
-                        
-            boost::asio::async_read_until(*socket, request->streambuf, "\r\n\r\n",
-                    [this, socket, request, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
-                if(timer)
-                    timer->cancel();
-                if(!ec) {
-                    //request->streambuf.size() is not necessarily the same as bytes_transferred, from Boost-docs:
-                    //"After a successful async_read_until operation, the streambuf may contain additional data beyond the delimiter"
-                    //The chosen solution is to extract lines from the stream directly when parsing the header. What is left of the
-                    //streambuf (maybe some bytes of the content) is appended to in the async_read-function below (for retrieving content).
-                    size_t num_additional_bytes=request->streambuf.size()-bytes_transferred;
-                    
-                    if(!parse_request(request))
-                        return;
-                    
-                    //If content, read that as well
-                    auto it=request->header.find("Content-Length");
-                    if(it!=request->header.end()) {
-                        unsigned long long content_length;
-                        try {
-                            content_length=stoull(it->second);
-                        }
-                        catch(const std::exception &e) {
-                            if(exception_handler)
-                                exception_handler(e);
-                            return;
-                        }
-                        if(content_length>num_additional_bytes) {
-                            //Set timeout on the following boost::asio::async-read or write function
-                            auto timer=get_timeout_timer(socket, timeout_content);
-                            boost::asio::async_read(*socket, request->streambuf,
-                                    boost::asio::transfer_exactly(content_length-num_additional_bytes),
-                                    [this, socket, request, timer]
-                                    (const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
-                                if(timer)
-                                    timer->cancel();
-                                if(!ec)
-                                    find_resource(socket, request);
-                            });
-                        }
-                        else
-                            find_resource(socket, request);
-                    }
-                    else
-                        find_resource(socket, request);
+            auto &leftover=connection->leftover;
+            if(!leftover.empty()) {
+                //The previous read already received the beginning of this request
+                {
+                    std::lock_guard<std::mutex> lock(connection->write_mutex);
+                    connection->corked=true;
                 }
-            });
+                auto &buffer=request->header_buffer;
+                if(buffer.size()<leftover.size())
+                    buffer.resize(leftover.size());
+                std::copy(leftover.begin(), leftover.end(), buffer.begin());
+                request->received=leftover.size();
+                leftover.clear();
+                set_read_timeout(connection, timeout_request);
+                parse_request_header(connection, request);
+                return;
+            }
+
+            //Set timeout on the following boost::asio::async-read or write function.
+            //An idle keep-alive connection gets timeout_request once the next request starts arriving.
+            set_read_timeout(connection, keep_alive?config.timeout_idle:timeout_request);
+
+            read_request_header(connection, request);
         }
 
-        bool parse_request(const std::shared_ptr<Request> &request) const {
-            std::string line;
-            getline(request->content, line);
-            size_t method_end;
-            if((method_end=line.find(' '))!=std::string::npos) {
-                size_t path_end;
-                if((path_end=line.find(' ', method_end+1))!=std::string::npos) {
-                    request->method=line.substr(0, method_end);
-                    request->path=line.substr(method_end+1, path_end-method_end-1);
-
-                    size_t protocol_end;
-                    if((protocol_end=line.find('/', path_end+1))!=std::string::npos) {
-                        if(line.substr(path_end+1, protocol_end-path_end-1)!="HTTP")
-                            return false;
-                        request->http_version=line.substr(protocol_end+1, line.size()-protocol_end-2);
-                    }
-                    else
-                        return false;
-
-                    getline(request->content, line);
-                    size_t param_end;
-                    while((param_end=line.find(':'))!=std::string::npos) {
-                        size_t value_start=param_end+1;
-                        if((value_start)<line.size()) {
-                            if(line[value_start]==' ')
-                                value_start++;
-                            if(value_start<line.size())
-                                request->header.insert(std::make_pair(line.substr(0, param_end), line.substr(value_start, line.size()-value_start-1)));
-                        }
-    
-                        getline(request->content, line);
-                    }
+        ///Reads into Request::header_buffer until the parser has seen the whole header
+        void read_request_header(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request) {
+            //Send the responses to the requests received so far while waiting
+            uncork(connection);
+
+            auto &buffer=request->header_buffer;
+            if(request->received==buffer.size()) {
+                if(buffer.size()>=config.max_request_header_size) {
+                    set_read_timeout(connection, 0);
+                    return;
                 }
-                else
-                    return false;
+                buffer.resize(std::min(buffer.size()*2, config.max_request_header_size));
+            }
+
+            connection->socket->async_read_some(boost::asio::buffer(&buffer[request->received], buffer.size()-request->received),
+                    [this, connection, request](const boost::system::error_code& ec, size_t bytes_transferred) {
+                if(ec) {
+                    set_read_timeout(connection, 0);
+                    return;
+                }
+                if(request->received==0)
+                    set_read_timeout(connection, timeout_request);
+                request->received+=bytes_transferred;
+                parse_request_header(connection, request);
+            });
+        }
+
+        ///Continues parsing the received part of the header, then reads the content
+        void parse_request_header(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request) {
+            auto result=request->parser.parse(request->header_buffer.data(), request->received);
+            if(result==RequestParser::incomplete) {
+                read_request_header(connection, request);
+                return;
+            }
+            set_read_timeout(connection, 0);
+            if(result==RequestParser::error) {
+                uncork(connection);
+                return;
+            }
+            request->set_header();
+
+            //Only Content-Length frames the content. A body in a transfer coding is not decoded, and its bytes
+            //must not be taken for the next request, so the request is answered and the connection closed.
+            auto it=request->header.find("Content-Length");
+            bool transfer_encoding=request->header.find("Transfer-Encoding")!=request->header.end();
+            if(transfer_encoding || request->header.count("Content-Length")>1) {
+                bool ambiguous=it!=request->header.end();
+                resource_function reject=[ambiguous](std::shared_ptr<Response> response, std::shared_ptr<Request> /*request*/) {
+                    *response << (ambiguous?"HTTP/1.1 400 Bad Request":"HTTP/1.1 501 Not Implemented")
+                              << "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                };
+                write_response(connection, request, reject, true);
+                return;
+            }
+            unsigned long long content_length=0;
+            if(it!=request->header.end() && !RequestParser::parse_number(it->second, content_length)) {
+                if(exception_handler)
+                    exception_handler(std::invalid_argument("invalid Content-Length"));
+                uncork(connection);
+                return;
+            }
+
+            //Bytes received after the header are the beginning of the content, followed by pipelined requests
+            auto header_size=request->parser.header_size();
+            auto num_additional_bytes=request->received-header_size;
+            auto num_content_bytes=static_cast<size_t>(std::min<unsigned long long>(num_additional_bytes, content_length));
+            if(num_content_bytes>0) {
+                auto content_buffer=request->streambuf.prepare(num_content_bytes);
+                boost::asio::buffer_copy(content_buffer, boost::asio::buffer(&request->header_buffer[header_size], num_content_bytes));
+                request->streambuf.commit(num_content_bytes);
+            }
+            auto next_request=request->header_buffer.begin()+static_cast<std::ptrdiff_t>(header_size+num_content_bytes);
+            connection->leftover.assign(next_request, next_request+static_cast<std::ptrdiff_t>(num_additional_bytes-num_content_bytes));
+
+            //If content, read that as well
+            if(content_length>num_content_bytes) {
+                uncork(connection);
+                //Set timeout on the following boost::asio::async-read or write function
+                set_read_timeout(connection, timeout_content);
+                boost::asio::async_read(*connection->socket, request->streambuf,
+                        boost::asio::transfer_exactly(static_cast<size_t>(content_length-num_content_bytes)),
+                        [this, connection, request]
+                        (const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
+                    set_read_timeout(connection, 0);
+                    if(!ec)
+                        find_resource(connection, request);
+                });
             }
             else
-                return false;
-            return true;
+                find_resource(connection, request);
         }
 
-        void find_resource(const std::shared_ptr<socket_type> &socket, const std::shared_ptr<Request> &request) {
+        void find_resource(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request) {
+            if(!opt_websocket.empty() && request->method=="GET") {
+                auto it=request->header.find("Upgrade");
+                if(it!=request->header.end() && boost::iequals(it->second, "websocket")) {
+                    for(auto &endpoint: opt_websocket) {
+                        if(REGEX_NS::regex_match(request->path.begin(), request->path.end(), request->path_match, endpoint.first)) {
+                            resource_function upgrade=[this, &endpoint](std::shared_ptr<Response> response, std::shared_ptr<Request> request) {
+                                upgrade_websocket(response, request, endpoint.first, *endpoint.second);
+                            };
+                            write_response(connection, request, upgrade, true);
+                            return;
+                        }
+                    }
+                }
+            }
             //Find path- and method-match, and call write_response
             for(auto& res: opt_resource) {
                 if(request->method==res.first) {
-                    for(auto& res_path: res.second) {
-                        REGEX_NS::smatch sm_res;
-                        if(REGEX_NS::regex_match(request->path, sm_res, res_path.first)) {
-                            request->path_match=std::move(sm_res);
-                            write_response(socket, request, res_path.second);
-                            return;
-                        }
+                    auto resource_function=res.second.find(request->path, request->path_match);
+                    if(resource_function) {
+                        write_response(connection, request, *resource_function);
+                        return;
                     }
+                    break;
                 }
             }
-            auto it_method=default_resource.find(request->method);
+            auto it_method=default_resource.find(request->method.to_string());
             if(it_method!=default_resource.end()) {
-                write_response(socket, request, it_method->second);
+                write_response(connection, request, it_method->second);
             }
+            else
+                uncork(connection);
         }
         
-        void write_response(const std::shared_ptr<socket_type> &socket, const std::shared_ptr<Request> &request, 
+        void write_response(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request, 
                 std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>,
-                                   std::shared_ptr<typename ServerBase<socket_type>::Request>)>& resource_function) {
-            //Set timeout on the following boost::asio::async-read or write function
-            auto timer=get_timeout_timer(socket, timeout_content);
-
-            auto response=std::shared_ptr<Response>(new Response(socket), [this, request, timer](Response *response_ptr) {
-                auto response=std::shared_ptr<Response>(response_ptr);
-                send(response, [this, response, request, timer](const boost::system::error_code& ec) {
-                    if(timer)
-                        timer->cancel();
-                    if(!ec) {
-                        float http_version;
-                        try {
-                            http_version=stof(request->http_version);
-                        }
-                        catch(const std::exception &e){
-                            if(exception_handler)
-                                exception_handler(e);
-                            return;
-                        }
-                        
-                        auto range=request->header.equal_range("Connection");
-                        for(auto it=range.first;it!=range.second;it++) {
-                            if(boost::iequals(it->second, "close"))
-                                return;
-                        }
-                        if(http_version>1.05)
-                            read_request_and_content(response->socket);
-                    }
-                });
+                                   std::shared_ptr<typename ServerBase<socket_type>::Request>)>& resource_function, bool last=false) {
+            //Keep the connection open from HTTP/1.1 on, unless the client asks to close it.
+            //After an upgrade or a rejected request (last), HTTP requests are no longer read, and the connection
+            //is closed when the response is released.
+            bool close=last;
+            for(auto& field: request->header) {
+                if(boost::iequals(field.first, "Connection") && boost::iequals(field.second, "close"))
+                    close=true;
+            }
+            auto &version=request->http_version;
+            bool http_1_1=version.size()>=3 && version[1]=='.' && (version[0]>'1' || (version[0]=='1' && version[2]>='1'));
+            if(!http_1_1)
+                close=true;
+
+            //Reserve the place of the response among the pending responses on the connection
+            size_t sequence;
+            bool read_next;
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                auto &exchanges=connection->exchanges;
+                if(exchanges.empty())
+                    exchanges.resize(std::max<size_t>(config.max_pipelined_requests, 1));
+                sequence=connection->exchanges_end++;
+                exchanges[sequence%exchanges.size()].close=close;
+                connection->read_paused=!close && connection->exchanges_end-connection->exchanges_begin>=exchanges.size();
+                read_next=!close && !connection->read_paused;
+
+                //Set timeout on the following boost::asio::async-read or write function
+                set_timeout(connection, timeout_content);
+            }
+
+            //When the handler releases the response, its output is handed to the connection,
+            //and after it has been sent, it is returned to the connection for the next request
+            auto response=make_response(connection, [this](Response *response_ptr) {
+                auto connection=response_ptr->connection;
+                queue_output(std::shared_ptr<Response>(response_ptr, ResponseRecycler{connection}, BlockCacheAllocator<Response>(connection->blocks)), nullptr, true);
             });
+            response->sequence=sequence;
+            response->chunked_allowed=http_1_1;
 
             try {
                 resource_function(response, request);
@@ -417,7 +1506,276 @@ namespace SimpleWeb {
             catch(const std::exception &e) {
                 if(exception_handler)
                     exception_handler(e);
+            }
+            response.reset();
+
+            //Read the next request while the response is pending. The next request may have been received already,
+            //and is then parsed in a new handler to keep the stack flat.
+            if(!read_next)
+                uncork(connection);
+            else if(!connection->leftover.empty()) {
+                connection->loop.io_service->post([this, connection] {
+                    read_request_and_content(connection, true);
+                });
+            }
+            else
+                read_request_and_content(connection, true);
+        }
+
+        ///Answers the upgrade request of a WebSocket endpoint with 101 Switching Protocols, and starts reading frames
+        void upgrade_websocket(const std::shared_ptr<Response> &response, const std::shared_ptr<Request> &request,
+                const REGEX_NS::regex &regex, WebSocketEndpoint &endpoint) {
+            auto key=request->header.find("Sec-WebSocket-Key");
+            auto version=request->header.find("Sec-WebSocket-Version");
+            if(key==request->header.end() || key->second.empty()) {
+                *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+                return;
+            }
+            if(version==request->header.end() || version->second!="13") {
+                *response << "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n";
+                return;
+            }
+
+            auto &connection=response->connection;
+            auto websocket=std::shared_ptr<WebSocket>(new WebSocket(*this, response));
+            websocket->path=request->path.to_string();
+            REGEX_NS::regex_match(websocket->path, websocket->path_match, regex);
+            websocket->remote_endpoint_address=request->remote_endpoint_address;
+            websocket->remote_endpoint_port=request->remote_endpoint_port;
+
+            *response << "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      << "Sec-WebSocket-Accept: " << WebSocketProtocol::accept_key(key->second) << "\r\n";
+            for(auto &field: request->header) {
+                if(boost::iequals(field.first, "Sec-WebSocket-Extensions")) {
+                    auto extensions=WebSocketDeflate::negotiate(field.second);
+                    if(!extensions.empty()) {
+                        *response << "Sec-WebSocket-Extensions: " << extensions << "\r\n";
+                        websocket->compress=true;
+                        break;
+                    }
+                }
+            }
+            *response << "\r\n";
+            {
+                std::lock_guard<std::mutex> lock(connection->write_mutex);
+                connection->upgraded=true;
+            }
+            send(response);
+
+            //Frames sent right after the upgrade request were received with it
+            auto &leftover=connection->leftover;
+            if(websocket->buffer.size()<leftover.size())
+                websocket->buffer.resize(leftover.size());
+            std::copy(leftover.begin(), leftover.end(), websocket->buffer.begin());
+            websocket->received=leftover.size();
+            leftover.clear();
+
+            if(endpoint.on_open) {
+                try {
+                    endpoint.on_open(websocket);
+                }
+                catch(const std::exception &e) {
+                    if(exception_handler)
+                        exception_handler(e);
+                }
+            }
+            connection->loop.io_service->post([this, websocket, &endpoint] {
+                read_websocket(websocket, endpoint);
+                ping_websocket(websocket);
+            });
+        }
+
+        ///Pings the client every half of timeout_idle, and closes the connection if nothing, not even a pong,
+        ///was received since the previous ping. A client that went away is otherwise only noticed when writes to it fail.
+        void ping_websocket(const std::shared_ptr<WebSocket> &websocket) {
+            if(config.timeout_idle<=0)
                 return;
+            websocket->ping_timer.expires_from_now(boost::posix_time::milliseconds(config.timeout_idle*500));
+            websocket->ping_timer.async_wait([this, websocket](const boost::system::error_code& ec) {
+                if(ec)
+                    return;
+                if(!websocket->received_since_ping) {
+                    boost::system::error_code ec;
+                    websocket->connection->socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+                    websocket->connection->socket->lowest_layer().close(ec);
+                    return;
+                }
+                websocket->received_since_ping=false;
+                auto frame=std::make_shared<std::string>();
+                WebSocketProtocol::write_header(*frame, 0x80|WebSocketProtocol::ping, 0);
+                websocket->send_frame(frame);
+                ping_websocket(websocket);
+            });
+        }
+
+        ///Handles the whole frames in the receive buffer of websocket, and reads until the next frame is complete
+        void read_websocket(const std::shared_ptr<WebSocket> &websocket, WebSocketEndpoint &endpoint) {
+            auto &buffer=websocket->buffer;
+            size_t begin=0;
+            size_t frame_size=0;
+            WebSocketProtocol::FrameHeader header;
+            while(header.parse(&buffer[begin], websocket->received-begin)) {
+                auto status=check_websocket_frame(*websocket, header);
+                if(status!=0) {
+                    websocket->send_close(status);
+                    close_websocket(websocket, endpoint, status, std::string());
+                    return;
+                }
+                if(websocket->received-begin-header.size<header.length) {
+                    frame_size=header.size+static_cast<size_t>(header.length);
+                    break;
+                }
+                auto payload=&buffer[begin+header.size];
+                auto length=static_cast<size_t>(header.length);
+                WebSocketProtocol::unmask(payload, length, header.mask);
+                begin+=header.size+length;
+                if(!handle_websocket_frame(websocket, endpoint, header, payload, length))
+                    return;
+            }
+
+            //Move the incomplete frame to the beginning of the buffer, and make room for all of it
+            if(begin>0) {
+                std::copy(buffer.begin()+static_cast<std::ptrdiff_t>(begin), buffer.begin()+static_cast<std::ptrdiff_t>(websocket->received), buffer.begin());
+                websocket->received-=begin;
+            }
+            if(buffer.size()<frame_size)
+                buffer.resize(frame_size);
+            else if(websocket->received==buffer.size())
+                buffer.resize(buffer.size()*2);
+
+            websocket->connection->socket->async_read_some(boost::asio::buffer(&buffer[websocket->received], buffer.size()-websocket->received),
+                    [this, websocket, &endpoint](const boost::system::error_code& ec, size_t bytes_transferred) {
+                if(ec) {
+                    if(endpoint.on_error) {
+                        try {
+                            endpoint.on_error(websocket, ec);
+                        }
+                        catch(const std::exception &e) {
+                            if(exception_handler)
+                                exception_handler(e);
+                        }
+                    }
+                    close_websocket(websocket, endpoint, 1006, std::string());
+                    return;
+                }
+                websocket->received+=bytes_transferred;
+                websocket->received_since_ping=true;
+                read_websocket(websocket, endpoint);
+            });
+        }
+
+        ///Returns the status to close the connection with if the frame of header is not allowed, or 0
+        int check_websocket_frame(const WebSocket &websocket, const WebSocketProtocol::FrameHeader &header) {
+            //Frames from clients are always masked, and the only extension is permessage-deflate on the first frame of a message
+            if(!header.masked || header.rsv2 || header.rsv3)
+                return 1002;
+            if(header.rsv1 && (!websocket.compress || (header.opcode!=WebSocketProtocol::text && header.opcode!=WebSocketProtocol::binary)))
+                return 1002;
+            switch(header.opcode) {
+            case WebSocketProtocol::close:
+            case WebSocketProtocol::ping:
+            case WebSocketProtocol::pong:
+                return (header.fin && header.length<=125)?0:1002;
+            case WebSocketProtocol::continuation:
+                if(websocket.message_opcode==0)
+                    return 1002;
+                break;
+            case WebSocketProtocol::text:
+            case WebSocketProtocol::binary:
+                if(websocket.message_opcode!=0)
+                    return 1002;
+                break;
+            default:
+                return 1002;
+            }
+            if(header.length>config.max_websocket_message_size-websocket.message_data.size())
+                return 1009;
+            return 0;
+        }
+
+        ///Returns false if the connection is closing
+        bool handle_websocket_frame(const std::shared_ptr<WebSocket> &websocket, WebSocketEndpoint &endpoint,
+                const WebSocketProtocol::FrameHeader &header, const char *payload, size_t length) {
+            switch(header.opcode) {
+            case WebSocketProtocol::close: {
+                if(length==1) {
+                    websocket->send_close(1002);
+                    close_websocket(websocket, endpoint, 1002, std::string());
+                    return false;
+                }
+                int status=1005;
+                std::string reason;
+                if(length>=2) {
+                    status=(static_cast<unsigned char>(payload[0])<<8)|static_cast<unsigned char>(payload[1]);
+                    reason.assign(payload+2, length-2);
+                }
+                //Answers the client's close frame, or completes the closing handshake started by send_close()
+                websocket->send_close(status==1005?0:status);
+                close_websocket(websocket, endpoint, status, reason);
+                return false;
+            }
+            case WebSocketProtocol::ping: {
+                auto frame=std::make_shared<std::string>();
+                WebSocketProtocol::write_header(*frame, 0x80|WebSocketProtocol::pong, length);
+                frame->append(payload, length);
+                websocket->send_frame(frame);
+                return true;
+            }
+            case WebSocketProtocol::pong:
+                return true;
+            }
+
+            if(header.opcode!=WebSocketProtocol::continuation) {
+                websocket->message_opcode=header.opcode;
+                websocket->message_compressed=header.rsv1;
+            }
+            websocket->message_data.append(payload, length);
+            if(!header.fin)
+                return true;
+
+            auto message=std::make_shared<typename WebSocket::Message>();
+            message->opcode=websocket->message_opcode;
+            message->data.swap(websocket->message_data);
+            websocket->message_opcode=0;
+            if(websocket->message_compressed && !websocket->inflater.decompress(message->data, config.max_websocket_message_size)) {
+                websocket->send_close(1009);
+                close_websocket(websocket, endpoint, 1009, std::string());
+                return false;
+            }
+            if(endpoint.on_message) {
+                try {
+                    endpoint.on_message(websocket, message);
+                }
+                catch(const std::exception &e) {
+                    if(exception_handler)
+                        exception_handler(e);
+                }
+            }
+            return true;
+        }
+
+        ///Stops reading websocket and releases its response, which closes the connection after the frames sent so far
+        void close_websocket(const std::shared_ptr<WebSocket> &websocket, WebSocketEndpoint &endpoint, int status, const std::string &reason) {
+            std::shared_ptr<Response> response;
+            {
+                std::lock_guard<std::mutex> lock(websocket->mutex);
+                if(websocket->closed)
+                    return;
+                websocket->closed=true;
+                websocket->close_sent=true;
+                response=std::move(websocket->response);
+            }
+            boost::system::error_code ec;
+            websocket->ping_timer.cancel(ec);
+            response.reset();
+            if(endpoint.on_close) {
+                try {
+                    endpoint.on_close(websocket, status, reason);
+                }
+                catch(const std::exception &e) {
+                    if(exception_handler)
+                        exception_handler(e);
+                }
             }
         }
     };
@@ -434,21 +1792,23 @@ namespace SimpleWeb {
                 ServerBase<HTTP>::ServerBase(port, num_threads, timeout_request, timeout_content) {}
         
     protected:
-        void accept() {
-            //Create new socket for this connection
+        void accept(Loop &loop) {
+            //Create new socket for this connection, on the io_service of the accepting loop
             //Shared_ptr is used to pass temporary objects to the asynchronous functions
-            auto socket=std::make_shared<HTTP>(*io_service);
+            auto connection=std::make_shared<Connection>(std::unique_ptr<HTTP>(new HTTP(*loop.io_service)), loop, config.max_pipelined_requests);
+            connection->self=connection;
                         
-            acceptor->async_accept(*socket, [this, socket](const boost::system::error_code& ec){
+            loop.acceptor->async_accept(*connection->socket, [this, connection, &loop](const boost::system::error_code& ec){
                 //Immediately start accepting a new connection (if io_service hasn't been stopped)
                 if (ec != boost::asio::error::operation_aborted)
-                    accept();
+                    accept(loop);
                                 
                 if(!ec) {
                     boost::asio::ip::tcp::no_delay option(true);
-                    socket->set_option(option);
+                    connection->socket->set_option(option);
+                    loop.connections++;
                     
-                    read_request_and_content(socket);
+                    read_request_and_content(connection);
                 }
             });
         }
@@ -0,0 +1,632 @@
+#ifndef STATIC_FILES_HPP
+#define	STATIC_FILES_HPP
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/functional/hash.hpp>
+
+#include "request_parser.hpp"
+
+#include <zlib.h>
+#ifdef USE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include <unordered_map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace SimpleWeb {
+    ///Serves the files below a web root. Small files are memory-mapped once and kept in a size-bounded LRU cache,
+    ///larger files are sent with sendfile(2), so no file content is copied through user space per request.
+    ///Cached text files are also kept gzip- and (with USE_BROTLI) brotli-compressed, chosen by Accept-Encoding.
+    ///They are compressed on a thread of their own, and sent uncompressed until then, so that the event loops do not wait for it.
+    class StaticFiles {
+    public:
+        class Config {
+            friend class StaticFiles;
+            Config() {}
+        public:
+            ///Maximum total size in bytes of the memory-mapped files kept in the cache.
+            size_t max_cache_size=64*1024*1024;
+            ///Files larger than this are not cached, but opened per request and sent with sendfile(2).
+            size_t max_cached_file_size=4*1024*1024;
+            ///Seconds between checks whether a cached file changed on disk. 0 checks on every request.
+            long revalidate_interval=1;
+            ///File served when a directory is requested.
+            std::string index_file="index.html";
+            ///Extensions of the files that are compressed after they have been loaded into the cache.
+            std::vector<std::string> compressed_extensions={".html", ".htm", ".js", ".css", ".json", ".svg", ".txt", ".xml", ".map"};
+            ///Files smaller than this are always sent uncompressed.
+            size_t min_compressed_file_size=256;
+            ///zlib compression level of the gzip variants, 0 disables them.
+            int gzip_level=9;
+            ///Brotli quality of the br variants, -1 disables them. Only used with USE_BROTLI.
+            int brotli_quality=9;
+            ///Cache-Control max-age in seconds for files without a matching entry in max_age.
+            ///0 sends Cache-Control: no-cache, so browsers revalidate with If-None-Match on every use.
+            long default_max_age=0;
+            ///Cache-Control max-age in seconds per request path prefix, for instance {"/static/", 3600}.
+            ///The longest matching prefix is used.
+            std::map<std::string, long> max_age;
+            ///Range requests with more ranges than this are answered with the whole file.
+            size_t max_ranges=16;
+        };
+        ///Set before serving the first request.
+        Config config;
+
+        class File {
+            friend class StaticFiles;
+        public:
+            ~File() {
+                if(data && size>0)
+                    munmap(const_cast<char*>(data), size);
+                if(fd>=0)
+                    ::close(fd);
+            }
+
+            boost::filesystem::path path;
+            size_t size;
+            time_t mtime;
+            ino_t inode;
+            ///Contents of the file if it is memory-mapped, otherwise nullptr and the file is read from fd
+            const char *data;
+            int fd;
+            ///True if the file is sent with Vary: Accept-Encoding
+            bool compressible;
+            ///Compressed contents, empty if the variant is not smaller than the file or not available.
+            ///Set once by the compression thread, and only read after compressed.
+            std::string gzip, brotli;
+            ///Set when gzip and brotli have been made
+            std::atomic<bool> compressed;
+            ///Strong entity tag of the uncompressed file, without quotes, derived from inode, mtime and size
+            std::string etag;
+            ///Modification time in HTTP-date format
+            std::string last_modified;
+            ///Value of the Cache-Control header
+            std::string cache_control;
+
+            ///Bytes of memory used by the cached file and its variants
+            size_t memory_size() const {
+                return size+gzip.size()+brotli.size();
+            }
+
+        private:
+            File(): size(0), mtime(0), inode(0), data(nullptr), fd(-1), compressible(false), compressed(false) {}
+
+            std::chrono::steady_clock::time_point last_checked;
+
+            bool changed(const struct stat &st) const {
+                return static_cast<size_t>(st.st_size)!=size || st.st_mtime!=mtime || st.st_ino!=inode;
+            }
+        };
+
+        StaticFiles(const std::string &web_root): web_root(boost::filesystem::canonical(web_root)), cache_size(0), stop_compression(false) {}
+        ~StaticFiles() {
+            {
+                std::lock_guard<std::mutex> lock(compression_mutex);
+                stop_compression=true;
+            }
+            compression_condition.notify_one();
+            if(compression_thread.joinable())
+                compression_thread.join();
+        }
+
+        StaticFiles(const StaticFiles&)=delete;
+        StaticFiles &operator=(const StaticFiles&)=delete;
+
+        ///Returns the file for the request path, from the cache if it is still up to date.
+        ///Throws std::invalid_argument if the path is outside the web root or cannot be read.
+        std::shared_ptr<File> get(boost::string_ref request_path) {
+            auto path=request_path.substr(0, request_path.find('?'));
+            auto now=std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                auto it=cache.find(path);
+                if(it!=cache.end()) {
+                    auto file=it->second->second;
+                    if(now-file->last_checked<std::chrono::seconds(config.revalidate_interval)) {
+                        lru.splice(lru.begin(), lru, it->second);
+                        return file;
+                    }
+                    struct stat st;
+                    if(stat(file->path.c_str(), &st)==0 && !file->changed(st)) {
+                        file->last_checked=now;
+                        lru.splice(lru.begin(), lru, it->second);
+                        return file;
+                    }
+                    erase(it);
+                }
+            }
+
+            auto file=open(resolve(path));
+            file->last_checked=now;
+            file->cache_control=cache_control(path);
+            if(file->data) {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                auto it=cache.find(path);
+                if(it!=cache.end())
+                    erase(it);
+                lru.emplace_front(path.to_string(), file);
+                cache.emplace(lru.front().first, lru.begin());
+                cache_size+=file->memory_size();
+                if(file->compressible && file->size>=config.min_compressed_file_size)
+                    queue_compression(lru.front().first, file);
+                while(cache_size>config.max_cache_size && lru.size()>1)
+                    erase(cache.find(lru.back().first));
+            }
+            return file;
+        }
+
+        ///Writes a 200 response with the file for request->path to response, compressed if the client accepts it.
+        ///Range requests are answered with 206 Partial Content of the uncompressed file.
+        ///Throws std::invalid_argument if the file cannot be served.
+        template<class response_type, class request_type>
+        void serve(const std::shared_ptr<response_type> &response, const std::shared_ptr<request_type> &request) {
+            auto file=get(request->path);
+
+            //Ranges always refer to the uncompressed file
+            auto range_it=request->header.find("Range");
+            bool range_request=range_it!=request->header.end();
+
+            const std::string *variant=nullptr;
+            const char *encoding=nullptr;
+            if(file->compressible && !range_request && file->compressed.load(std::memory_order_acquire) &&
+               (!file->brotli.empty() || !file->gzip.empty())) {
+                auto it=request->header.find("Accept-Encoding");
+                if(it!=request->header.end()) {
+                    if(!file->brotli.empty() && accepts_encoding(it->second, "br")) {
+                        variant=&file->brotli;
+                        encoding="br";
+                    }
+                    else if(!file->gzip.empty() && accepts_encoding(it->second, "gzip")) {
+                        variant=&file->gzip;
+                        encoding="gzip";
+                    }
+                }
+            }
+
+            //Every encoding is a different representation and needs its own strong entity tag
+            auto etag="\""+file->etag+(variant?(variant==&file->brotli?"-br":"-gz"):"")+"\"";
+            if(not_modified(*request, *file, etag)) {
+                *response << "HTTP/1.1 304 Not Modified\r\n";
+                write_cache_headers(*response, *file, etag);
+                *response << "\r\n";
+                return;
+            }
+
+            std::vector<std::pair<size_t, size_t> > ranges;
+            if(range_request && if_range_matches(*request, *file, etag) && parse_ranges(range_it->second, file->size, ranges)) {
+                if(ranges.empty()) {
+                    *response << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                              << "Content-Range: bytes */" << file->size << "\r\n"
+                              << "Content-Length: 0\r\n\r\n";
+                    return;
+                }
+                if(ranges.size()<=config.max_ranges) {
+                    write_ranges(response, file, etag, ranges);
+                    return;
+                }
+            }
+
+            *response << "HTTP/1.1 200 OK\r\n";
+            write_cache_headers(*response, *file, etag);
+            *response << "Accept-Ranges: bytes\r\n";
+            if(variant) {
+                *response << "Content-Encoding: " << encoding << "\r\nContent-Length: " << variant->size() << "\r\n\r\n";
+                response->write_shared(file, variant->data(), variant->size());
+            }
+            else {
+                *response << "Content-Length: " << file->size << "\r\n\r\n";
+                write_content(*response, file, 0, file->size);
+            }
+        }
+
+        ///Parses the byte ranges of a Range header value into ranges of first and last byte positions.
+        ///Returns false if the header is invalid and must be ignored. Leaves ranges empty if no range is satisfiable.
+        static bool parse_ranges(boost::string_ref range, size_t size, std::vector<std::pair<size_t, size_t> > &ranges) {
+            ranges.clear();
+            if(!boost::istarts_with(range, "bytes="))
+                return false;
+            range.remove_prefix(6);
+            size_t pos=0;
+            while(pos<range.size()) {
+                auto spec=next_list_element(range, pos);
+                if(spec.empty())
+                    continue;
+                auto dash=spec.find('-');
+                if(dash==boost::string_ref::npos)
+                    return false;
+                auto first=spec.substr(0, dash);
+                auto last=spec.substr(dash+1);
+                unsigned long long first_pos, last_pos;
+                if(first.empty()) {
+                    //Suffix range: the last bytes of the file
+                    if(!RequestParser::parse_number(last, last_pos))
+                        return false;
+                    if(last_pos>0 && size>0)
+                        ranges.emplace_back(size-std::min<size_t>(last_pos, size), size-1);
+                }
+                else {
+                    if(!RequestParser::parse_number(first, first_pos))
+                        return false;
+                    if(last.empty())
+                        last_pos=size-1;
+                    else if(!RequestParser::parse_number(last, last_pos) || last_pos<first_pos)
+                        return false;
+                    if(first_pos<size)
+                        ranges.emplace_back(first_pos, std::min<size_t>(last_pos, size-1));
+                }
+            }
+            return true;
+        }
+
+        ///Returns true if one of the entity tags in the If-None-Match header value matches etag.
+        ///Uses the weak comparison required for If-None-Match.
+        static bool etag_matches(boost::string_ref if_none_match, boost::string_ref etag) {
+            size_t pos=0;
+            while(pos<if_none_match.size()) {
+                auto tag=next_list_element(if_none_match, pos);
+                if(tag=="*")
+                    return true;
+                if(boost::starts_with(tag, "W/"))
+                    tag.remove_prefix(2);
+                if(tag==etag)
+                    return true;
+            }
+            return false;
+        }
+
+        ///Returns the time in HTTP-date format
+        static std::string http_date(time_t time) {
+            struct tm tm;
+            gmtime_r(&time, &tm);
+            char date[64];
+            strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            return date;
+        }
+
+        ///Returns the time of an HTTP-date, or -1 if date cannot be parsed
+        static time_t parse_http_date(boost::string_ref date) {
+            char terminated_date[64];
+            if(date.size()>=sizeof(terminated_date))
+                return -1;
+            std::copy(date.begin(), date.end(), terminated_date);
+            terminated_date[date.size()]='\0';
+            struct tm tm={};
+            auto end=strptime(terminated_date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            if(!end || *end!='\0')
+                return -1;
+            return timegm(&tm);
+        }
+
+        ///Returns true if the Accept-Encoding header value accepts encoding with a nonzero quality
+        static bool accepts_encoding(boost::string_ref accept_encoding, boost::string_ref encoding) {
+            bool accepted=false;
+            size_t pos=0;
+            while(pos<accept_encoding.size()) {
+                auto coding=next_list_element(accept_encoding, pos);
+                boost::string_ref quality;
+                auto parameters=coding.find(';');
+                if(parameters!=boost::string_ref::npos) {
+                    quality=trim(coding.substr(parameters+1));
+                    coding=trim(coding.substr(0, parameters));
+                }
+                //Explicit codings take precedence over *
+                bool explicit_coding=boost::iequals(coding, encoding);
+                if(explicit_coding || coding=="*") {
+                    //A quality value of 0 (or 0.0 to 0.000) means not acceptable
+                    bool zero_quality=boost::istarts_with(quality, "q=") && quality.size()>2 &&
+                                      quality.substr(2).find_first_not_of("0.")==boost::string_ref::npos;
+                    if(explicit_coding)
+                        return !zero_quality;
+                    accepted=!zero_quality;
+                }
+            }
+            return accepted;
+        }
+
+    private:
+        boost::filesystem::path web_root;
+
+        static boost::string_ref trim(boost::string_ref value) {
+            while(!value.empty() && (value.front()==' ' || value.front()=='\t'))
+                value.remove_prefix(1);
+            while(!value.empty() && (value.back()==' ' || value.back()=='\t'))
+                value.remove_suffix(1);
+            return value;
+        }
+
+        ///Returns the trimmed element of a comma-separated header value at pos, and moves pos past it
+        static boost::string_ref next_list_element(boost::string_ref list, size_t &pos) {
+            auto end=list.substr(pos).find(',');
+            end=end==boost::string_ref::npos?list.size():pos+end;
+            auto element=trim(list.substr(pos, end-pos));
+            pos=end+1;
+            return element;
+        }
+
+        template<class request_type>
+        static bool not_modified(const request_type &request, const File &file, const std::string &etag) {
+            auto it=request.header.find("If-None-Match");
+            if(it!=request.header.end())
+                return etag_matches(it->second, etag);
+            //If-Modified-Since is only evaluated without If-None-Match
+            it=request.header.find("If-Modified-Since");
+            if(it!=request.header.end()) {
+                auto since=parse_http_date(it->second);
+                return since!=-1 && file.mtime<=since;
+            }
+            return false;
+        }
+
+        ///If-Range with an entity tag requires a strong match, with a date the exact modification time
+        template<class request_type>
+        static bool if_range_matches(const request_type &request, const File &file, const std::string &etag) {
+            auto it=request.header.find("If-Range");
+            if(it==request.header.end())
+                return true;
+            if(boost::starts_with(it->second, "\"") || boost::starts_with(it->second, "W/"))
+                return it->second==etag;
+            return it->second==file.last_modified;
+        }
+
+        template<class response_type>
+        static void write_content(response_type &response, const std::shared_ptr<File> &file, size_t offset, size_t length) {
+            if(file->data)
+                response.write_shared(file, file->data+offset, length);
+            else
+                response.write_file(file, file->fd, static_cast<off_t>(offset), length);
+        }
+
+        template<class response_type>
+        void write_ranges(const std::shared_ptr<response_type> &response, const std::shared_ptr<File> &file, const std::string &etag,
+                          const std::vector<std::pair<size_t, size_t> > &ranges) const {
+            *response << "HTTP/1.1 206 Partial Content\r\n";
+            write_cache_headers(*response, *file, etag);
+            if(ranges.size()==1) {
+                auto &range=ranges.front();
+                *response << "Content-Range: bytes " << range.first << '-' << range.second << '/' << file->size << "\r\n"
+                          << "Content-Length: " << range.second-range.first+1 << "\r\n\r\n";
+                write_content(*response, file, range.first, range.second-range.first+1);
+                return;
+            }
+
+            //multipart/byteranges: the part headers are built first to compute the Content-Length
+            auto boundary="rs_web_byteranges_"+file->etag;
+            std::vector<std::string> part_headers;
+            size_t content_length=0;
+            for(auto &range: ranges) {
+                part_headers.emplace_back("\r\n--"+boundary+"\r\nContent-Range: bytes "+std::to_string(range.first)+'-'+
+                                          std::to_string(range.second)+'/'+std::to_string(file->size)+"\r\n\r\n");
+                content_length+=part_headers.back().size()+range.second-range.first+1;
+            }
+            auto end_boundary="\r\n--"+boundary+"--\r\n";
+            content_length+=end_boundary.size();
+
+            *response << "Content-Type: multipart/byteranges; boundary=" << boundary << "\r\n"
+                      << "Content-Length: " << content_length << "\r\n\r\n";
+            for(size_t c=0;c<ranges.size();c++) {
+                *response << part_headers[c];
+                write_content(*response, file, ranges[c].first, ranges[c].second-ranges[c].first+1);
+            }
+            *response << end_boundary;
+        }
+
+        template<class response_type>
+        static void write_cache_headers(response_type &response, const File &file, const std::string &etag) {
+            response << "ETag: " << etag << "\r\n"
+                     << "Last-Modified: " << file.last_modified << "\r\n"
+                     << "Cache-Control: " << file.cache_control << "\r\n";
+            if(file.compressible)
+                response << "Vary: Accept-Encoding\r\n";
+        }
+
+        std::string cache_control(boost::string_ref request_path) const {
+            auto max_age=config.default_max_age;
+            size_t prefix_length=0;
+            for(auto &prefix: config.max_age) {
+                if(prefix.first.size()>=prefix_length && boost::starts_with(request_path, prefix.first)) {
+                    max_age=prefix.second;
+                    prefix_length=prefix.first.size();
+                }
+            }
+            if(max_age<=0)
+                return "no-cache";
+            return "public, max-age="+std::to_string(max_age);
+        }
+
+        class string_ref_hash {
+        public:
+            size_t operator()(boost::string_ref key) const {
+                return boost::hash_range(key.begin(), key.end());
+            }
+        };
+
+        typedef std::list<std::pair<std::string, std::shared_ptr<File> > > lru_type;
+        lru_type lru;
+        ///Keys refer to the request paths stored in lru
+        typedef std::unordered_map<boost::string_ref, lru_type::iterator, string_ref_hash> cache_type;
+        cache_type cache;
+        size_t cache_size;
+        std::mutex cache_mutex;
+
+        ///Cached files waiting to be compressed, by request path
+        std::deque<std::pair<std::string, std::weak_ptr<File> > > compression_queue;
+        std::mutex compression_mutex;
+        std::condition_variable compression_condition;
+        bool stop_compression;
+        std::thread compression_thread;
+
+        void erase(cache_type::iterator it) {
+            auto lru_it=it->second;
+            cache_size-=lru_it->second->memory_size();
+            cache.erase(it);
+            lru.erase(lru_it);
+        }
+
+        boost::filesystem::path resolve(boost::string_ref request_path) const {
+            auto path=boost::filesystem::canonical(web_root/request_path.to_string());
+            //Check if path is within web_root
+            if(std::distance(web_root.begin(), web_root.end())>std::distance(path.begin(), path.end()) ||
+               !std::equal(web_root.begin(), web_root.end(), path.begin()))
+                throw std::invalid_argument("path must be within root path");
+            if(boost::filesystem::is_directory(path))
+                path/=config.index_file;
+            if(!(boost::filesystem::exists(path) && boost::filesystem::is_regular_file(path)))
+                throw std::invalid_argument("file does not exist");
+            return path;
+        }
+
+        std::shared_ptr<File> open(const boost::filesystem::path &path) const {
+            std::shared_ptr<File> file(new File());
+            file->path=path;
+            file->fd=::open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if(file->fd<0 || fstat(file->fd, &st)!=0)
+                throw std::invalid_argument("could not read file");
+            file->size=static_cast<size_t>(st.st_size);
+            file->mtime=st.st_mtime;
+            file->inode=st.st_ino;
+            char etag[64];
+            snprintf(etag, sizeof(etag), "%llx-%llx-%llx", static_cast<unsigned long long>(file->inode),
+                     static_cast<unsigned long long>(file->mtime), static_cast<unsigned long long>(file->size));
+            file->etag=etag;
+            file->last_modified=http_date(file->mtime);
+
+            if(file->size<=config.max_cached_file_size) {
+                if(file->size>0) {
+                    void *data=mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+                    if(data==MAP_FAILED)
+                        return file;
+                    file->data=static_cast<const char*>(data);
+                }
+                else
+                    file->data="";
+                ::close(file->fd);
+                file->fd=-1;
+
+                auto extension=path.extension().string();
+                file->compressible=std::find_if(config.compressed_extensions.begin(), config.compressed_extensions.end(), [&extension](const std::string &e) {
+                    return boost::iequals(e, extension);
+                })!=config.compressed_extensions.end();
+            }
+            return file;
+        }
+
+        ///Has the compression thread, started on first use, make the variants of file. Is called with cache_mutex locked.
+        void queue_compression(const std::string &request_path, const std::shared_ptr<File> &file) {
+            {
+                std::lock_guard<std::mutex> lock(compression_mutex);
+                compression_queue.emplace_back(request_path, file);
+                if(!compression_thread.joinable())
+                    compression_thread=std::thread([this] {
+                        compress_files();
+                    });
+            }
+            compression_condition.notify_one();
+        }
+
+        ///Compresses the queued files that are still cached, and adds the variants to the cache
+        void compress_files() {
+            std::unique_lock<std::mutex> lock(compression_mutex);
+            while(true) {
+                compression_condition.wait(lock, [this] {
+                    return stop_compression || !compression_queue.empty();
+                });
+                if(stop_compression)
+                    return;
+                auto queued=std::move(compression_queue.front());
+                compression_queue.pop_front();
+                lock.unlock();
+
+                if(auto file=queued.second.lock()) {
+                    auto gzip=gzip_compress(file->data, file->size, config.gzip_level);
+                    if(gzip.size()>=file->size)
+                        gzip.clear();
+                    auto brotli=brotli_compress(file->data, file->size, config.brotli_quality);
+                    if(brotli.size()>=file->size)
+                        brotli.clear();
+
+                    std::lock_guard<std::mutex> cache_lock(cache_mutex);
+                    auto it=cache.find(queued.first);
+                    if(it!=cache.end() && it->second->second==file) {
+                        file->gzip.swap(gzip);
+                        file->brotli.swap(brotli);
+                        file->compressed.store(true, std::memory_order_release);
+                        cache_size+=file->gzip.size()+file->brotli.size();
+                        while(cache_size>config.max_cache_size && lru.size()>1)
+                            erase(cache.find(lru.back().first));
+                    }
+                }
+                lock.lock();
+            }
+        }
+
+        ///Returns data compressed in gzip format, or an empty string on failure
+        static std::string gzip_compress(const char *data, size_t size, int level) {
+            std::string compressed;
+            if(level<=0)
+                return compressed;
+            z_stream stream;
+            stream.zalloc=Z_NULL;
+            stream.zfree=Z_NULL;
+            stream.opaque=Z_NULL;
+            //15+16: maximum window size with a gzip header and trailer
+            if(deflateInit2(&stream, level, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY)!=Z_OK)
+                return compressed;
+            compressed.resize(deflateBound(&stream, size));
+            stream.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            stream.avail_in=static_cast<uInt>(size);
+            stream.next_out=reinterpret_cast<Bytef*>(&compressed[0]);
+            stream.avail_out=static_cast<uInt>(compressed.size());
+            if(deflate(&stream, Z_FINISH)==Z_STREAM_END)
+                compressed.resize(stream.total_out);
+            else
+                compressed.clear();
+            deflateEnd(&stream);
+            return compressed;
+        }
+
+        ///Returns data compressed in brotli format, or an empty string on failure or without USE_BROTLI
+        static std::string brotli_compress(const char *data, size_t size, int quality) {
+            std::string compressed;
+#ifdef USE_BROTLI
+            if(quality<0)
+                return compressed;
+            compressed.resize(BrotliEncoderMaxCompressedSize(size));
+            size_t compressed_size=compressed.size();
+            if(BrotliEncoderCompress(std::min(quality, BROTLI_MAX_QUALITY), BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, size,
+                                     reinterpret_cast<const uint8_t*>(data), &compressed_size, reinterpret_cast<uint8_t*>(&compressed[0])))
+                compressed.resize(compressed_size);
+            else
+                compressed.clear();
+#else
+            (void)data;
+            (void)size;
+            (void)quality;
+#endif
+            return compressed;
+        }
+    };
+}
+#endif	/* STATIC_FILES_HPP */
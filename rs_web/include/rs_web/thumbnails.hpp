@@ -0,0 +1,395 @@
+#ifndef THUMBNAILS_HPP
+#define	THUMBNAILS_HPP
+
+#include "result_cache.hpp"
+
+#include <memory>
+#include <vector>
+#include <list>
+#include <string>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <csetjmp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <jpeglib.h>
+#ifdef USE_WEBP
+#include <webp/encode.h>
+#endif
+
+namespace SimpleWeb {
+    ///An image with 3 interleaved 8-bit channels, stored row by row without padding
+    class Image {
+    public:
+        Image(size_t width, size_t height, bool bgr): width(width), height(height), bgr(bgr), data(width*height*3) {}
+        size_t width, height;
+        ///Set if the channels are blue, green, red, as in the images logged by RoboSherlock, else red, green, blue
+        bool bgr;
+        std::vector<unsigned char> data;
+    };
+
+    ///Source of the images that thumbnails are made of, such as the color_image_hd collection in MongoDB
+    class ImageStore {
+    public:
+        virtual ~ImageStore() {}
+        ///Returns the image named id, or nullptr if there is none. Called from several threads at once.
+        ///Throws std::runtime_error if the image cannot be read.
+        virtual std::shared_ptr<const Image> load(const std::string &id)=0;
+    };
+
+    ///Images stored as binary PPM files (P6, 8-bit) named <id>.ppm in a directory, for instance to stand in for MongoDB in tests
+    class FileImageStore : public ImageStore {
+    public:
+        FileImageStore(const std::string &directory): directory(directory) {}
+
+        std::shared_ptr<const Image> load(const std::string &id) override {
+            //Ids cannot leave the directory
+            if(id.empty() || id[0]=='.' || id.find('/')!=std::string::npos)
+                return nullptr;
+            std::ifstream file(directory+"/"+id+".ppm", std::ios::binary);
+            if(!file)
+                return nullptr;
+            size_t width, height, max_value;
+            if(!(read_token(file)=="P6" && read_number(file, width) && read_number(file, height) && read_number(file, max_value)) ||
+               max_value!=255 || width==0 || height==0 || width>65535 || height>65535)
+                throw std::runtime_error("unsupported image "+id+".ppm");
+            //A single whitespace character separates the header from the pixels
+            file.get();
+            auto image=std::make_shared<Image>(width, height, false);
+            if(!file.read(reinterpret_cast<char*>(image->data.data()), static_cast<std::streamsize>(image->data.size())))
+                throw std::runtime_error("truncated image "+id+".ppm");
+            return image;
+        }
+
+    private:
+        std::string directory;
+
+        static std::string read_token(std::istream &stream) {
+            std::string token;
+            while(stream >> token && token[0]=='#') {
+                std::string comment;
+                std::getline(stream, comment);
+            }
+            return token;
+        }
+
+        static bool read_number(std::istream &stream, size_t &number) {
+            auto token=read_token(stream);
+            if(token.empty() || token.find_first_not_of("0123456789")!=std::string::npos || token.size()>9)
+                return false;
+            number=std::stoul(token);
+            return true;
+        }
+    };
+
+    ///Thumbnails of regions of the images in an ImageStore, cropped, scaled down and encoded as JPEG (or WebP, with USE_WEBP).
+    ///Encoded thumbnails are cached by image, region, size and format, and the last decoded images are kept, since the
+    ///thumbnails of the objects in a scene are cut from the same image.
+    class Thumbnails {
+    public:
+        enum Format {jpeg, webp};
+
+        class Thumbnail {
+        public:
+            std::string id;
+            ///The region of interest in the image, clipped to the image. The whole image if width or height is 0.
+            size_t x, y, width, height;
+            ///The region is scaled down to fit into max_width×max_height, keeping its aspect ratio. It is never scaled up.
+            size_t max_width, max_height;
+            Format format;
+        };
+
+        class Config {
+            friend class Thumbnails;
+        private:
+            Config(): jpeg_quality(80), webp_quality(80), max_size(2048), max_images(4) {}
+        public:
+            int jpeg_quality;
+            float webp_quality;
+            ///Largest max_width and max_height accepted
+            size_t max_size;
+            ///Number of decoded images kept
+            size_t max_images;
+        };
+        ///Set before calling get
+        Config config;
+
+        Thumbnails(const std::shared_ptr<ImageStore> &store, size_t max_entries=10000, size_t max_bytes=64*1024*1024):
+                store(store), cache(max_entries, max_bytes, std::chrono::hours(24)) {}
+
+        Thumbnails(const Thumbnails&)=delete;
+        Thumbnails &operator=(const Thumbnails&)=delete;
+
+        ///Calls callback with the encoded thumbnail, or with nullptr if the image is not in the store, the region is empty,
+        ///or the image could not be read. The thumbnail is made on the calling thread, unless it is cached or being made
+        ///by another thread, which then calls callback. Throws std::invalid_argument if thumbnail is invalid.
+        void get(const Thumbnail &thumbnail, const ResultCache::Callback &callback) {
+            validate(thumbnail);
+            cache.get(key(thumbnail), [this, thumbnail](const ResultCache::Callback &done) {
+                std::shared_ptr<const std::string> result;
+                try {
+                    result=make(thumbnail);
+                }
+                catch(const std::exception &) {
+                }
+                done(result);
+            }, callback);
+        }
+
+        ///Returns the encoded thumbnail, or nullptr as get() with a callback, waiting for it if another thread is making it
+        std::shared_ptr<const std::string> get(const Thumbnail &thumbnail) {
+            auto promise=std::make_shared<std::promise<std::shared_ptr<const std::string> > >();
+            auto future=promise->get_future();
+            get(thumbnail, [promise](const std::shared_ptr<const std::string> &result) {
+                promise->set_value(result);
+            });
+            return future.get();
+        }
+
+        ///Drops the cached thumbnails and images, for instance after images have been replaced in the store
+        void clear() {
+            cache.clear();
+            std::lock_guard<std::mutex> lock(images_mutex);
+            images.clear();
+        }
+
+        ResultCache::Statistics statistics() {
+            return cache.statistics();
+        }
+
+        ///Throws std::invalid_argument if thumbnail is invalid, as get() does
+        void validate(const Thumbnail &thumbnail) {
+            if(thumbnail.max_width==0 || thumbnail.max_height==0 || thumbnail.max_width>config.max_size || thumbnail.max_height>config.max_size)
+                throw std::invalid_argument("thumbnail size must be between 1 and "+std::to_string(config.max_size));
+#ifndef USE_WEBP
+            if(thumbnail.format==webp)
+                throw std::invalid_argument("WebP is not supported");
+#endif
+        }
+
+        static const char *content_type(Format format) {
+            return format==webp?"image/webp":"image/jpeg";
+        }
+
+        ///Area-averaging resize of the region x, y, width, height of source to target_width×target_height, as cv::INTER_AREA
+        ///when shrinking. The result is always red, green, blue. The weights are computed once per axis. The vertical pass
+        ///runs first, over whole rows of the region with SSE2 where available, so that the horizontal pass, which gathers
+        ///pixels and is not vectorized, only runs once per target row.
+        static std::shared_ptr<Image> resize(const Image &source, size_t x, size_t y, size_t width, size_t height,
+                                             size_t target_width, size_t target_height) {
+            auto columns=area_weights(width, target_width);
+            auto rows=area_weights(height, target_height);
+            auto result=std::make_shared<Image>(target_width, target_height, false);
+            //Swapping the channels while converting costs nothing and spares the encoders a conversion
+            size_t red=source.bgr?2:0, blue=source.bgr?0:2;
+
+            auto row_size=width*3;
+            std::vector<float> row(row_size, 0.0f);
+            std::vector<float> target_row(target_width*3);
+            for(size_t c=0;c<rows.size();c++) {
+                //Vertical pass: rows are ordered by source row, so the target rows are completed one after the other
+                accumulate(row.data(), source.data.data()+((y+rows[c].source)*source.width+x)*3, row_size, rows[c].weight);
+                if(c+1<rows.size() && rows[c+1].target==rows[c].target)
+                    continue;
+
+                //Horizontal pass over the completed row
+                std::fill(target_row.begin(), target_row.end(), 0.0f);
+                for(auto &column: columns) {
+                    auto in=row.data()+column.source*3;
+                    auto out=target_row.data()+column.target*3;
+                    out[0]+=column.weight*in[0];
+                    out[1]+=column.weight*in[1];
+                    out[2]+=column.weight*in[2];
+                }
+                auto pixels=result->data.data()+rows[c].target*target_width*3;
+                for(size_t i=0;i<target_row.size();i+=3) {
+                    pixels[i]=to_byte(target_row[i+red]);
+                    pixels[i+1]=to_byte(target_row[i+1]);
+                    pixels[i+2]=to_byte(target_row[i+blue]);
+                }
+                std::fill(row.begin(), row.end(), 0.0f);
+            }
+            return result;
+        }
+
+        static std::string encode_jpeg(const Image &image, int quality) {
+            jpeg_compress_struct compress;
+            JpegError error;
+            compress.err=jpeg_std_error(&error.manager);
+            error.manager.error_exit=&JpegError::exit;
+            //Written by libjpeg through their address, so they are valid after longjmp
+            unsigned char *output=nullptr;
+            unsigned long size=0;
+            if(setjmp(error.jump)) {
+                jpeg_destroy_compress(&compress);
+                std::free(output);
+                throw std::runtime_error(std::string("could not encode JPEG: ")+error.message);
+            }
+            jpeg_create_compress(&compress);
+            jpeg_mem_dest(&compress, &output, &size);
+            compress.image_width=static_cast<JDIMENSION>(image.width);
+            compress.image_height=static_cast<JDIMENSION>(image.height);
+            compress.input_components=3;
+            compress.in_color_space=JCS_RGB;
+            jpeg_set_defaults(&compress);
+            jpeg_set_quality(&compress, quality, TRUE);
+            jpeg_start_compress(&compress, TRUE);
+            while(compress.next_scanline<compress.image_height) {
+                auto row=const_cast<JSAMPROW>(image.data.data()+compress.next_scanline*image.width*3);
+                jpeg_write_scanlines(&compress, &row, 1);
+            }
+            jpeg_finish_compress(&compress);
+            jpeg_destroy_compress(&compress);
+            std::string result(reinterpret_cast<const char*>(output), size);
+            std::free(output);
+            return result;
+        }
+
+#ifdef USE_WEBP
+        static std::string encode_webp(const Image &image, float quality) {
+            uint8_t *output=nullptr;
+            auto size=WebPEncodeRGB(image.data.data(), static_cast<int>(image.width), static_cast<int>(image.height),
+                                    static_cast<int>(image.width*3), quality, &output);
+            if(size==0)
+                throw std::runtime_error("could not encode WebP");
+            std::string result(reinterpret_cast<const char*>(output), size);
+            //Allocated with malloc by libwebp, which older versions have no WebPFree for
+            std::free(output);
+            return result;
+        }
+#endif
+
+    private:
+        class Weight {
+        public:
+            size_t source, target;
+            float weight;
+        };
+
+        class JpegError {
+        public:
+            jpeg_error_mgr manager;
+            std::jmp_buf jump;
+            char message[JMSG_LENGTH_MAX];
+
+            static void exit(j_common_ptr info) {
+                auto error=reinterpret_cast<JpegError*>(info->err);
+                (*info->err->format_message)(info, error->message);
+                std::longjmp(error->jump, 1);
+            }
+        };
+
+        std::shared_ptr<ImageStore> store;
+        ResultCache cache;
+
+        std::mutex images_mutex;
+        ///The last decoded images, most recently used first
+        std::list<std::pair<std::string, std::shared_ptr<const Image> > > images;
+
+        static std::string key(const Thumbnail &thumbnail) {
+            return thumbnail.id+"/"+std::to_string(thumbnail.x)+","+std::to_string(thumbnail.y)+","+std::to_string(thumbnail.width)+","+
+                   std::to_string(thumbnail.height)+"/"+std::to_string(thumbnail.max_width)+"x"+std::to_string(thumbnail.max_height)+
+                   (thumbnail.format==webp?".webp":".jpg");
+        }
+
+        std::shared_ptr<const std::string> make(const Thumbnail &thumbnail) {
+            auto image=load(thumbnail.id);
+            if(!image)
+                return nullptr;
+            size_t x=thumbnail.x, y=thumbnail.y, width=thumbnail.width, height=thumbnail.height;
+            if(width==0 || height==0) {
+                x=y=0;
+                width=image->width;
+                height=image->height;
+            }
+            if(x>=image->width || y>=image->height)
+                return nullptr;
+            width=std::min(width, image->width-x);
+            height=std::min(height, image->height-y);
+
+            auto scale=std::min(1.0, std::min(static_cast<double>(thumbnail.max_width)/width, static_cast<double>(thumbnail.max_height)/height));
+            auto target_width=std::max<size_t>(1, static_cast<size_t>(std::lround(width*scale)));
+            auto target_height=std::max<size_t>(1, static_cast<size_t>(std::lround(height*scale)));
+            auto small=resize(*image, x, y, width, height, target_width, target_height);
+#ifdef USE_WEBP
+            if(thumbnail.format==webp)
+                return std::make_shared<std::string>(encode_webp(*small, config.webp_quality));
+#endif
+            return std::make_shared<std::string>(encode_jpeg(*small, config.jpeg_quality));
+        }
+
+        std::shared_ptr<const Image> load(const std::string &id) {
+            {
+                std::lock_guard<std::mutex> lock(images_mutex);
+                for(auto it=images.begin();it!=images.end();it++) {
+                    if(it->first==id) {
+                        images.splice(images.begin(), images, it);
+                        return it->second;
+                    }
+                }
+            }
+            auto image=store->load(id);
+            if(image && config.max_images>0) {
+                std::lock_guard<std::mutex> lock(images_mutex);
+                images.emplace_front(id, image);
+                if(images.size()>config.max_images)
+                    images.pop_back();
+            }
+            return image;
+        }
+
+        ///The overlap of every source pixel with every target pixel along an axis, relative to the size of a target pixel,
+        ///ordered by source pixel
+        static std::vector<Weight> area_weights(size_t size, size_t target_size) {
+            std::vector<Weight> weights;
+            weights.reserve(size+target_size);
+            auto scale=static_cast<double>(size)/target_size;
+            for(size_t source=0;source<size;source++) {
+                //The source pixel covers [source, source+1) in source coordinates, a target pixel [target*scale, (target+1)*scale)
+                auto target=static_cast<size_t>(source/scale);
+                for(;target<target_size && target*scale<source+1;target++) {
+                    auto overlap=std::min<double>(source+1, (target+1)*scale)-std::max<double>(source, target*scale);
+                    if(overlap>1e-9)
+                        weights.emplace_back(Weight{source, target, static_cast<float>(overlap/scale)});
+                }
+            }
+            return weights;
+        }
+
+        ///out[i]+=weight*in[i] for i below size
+        static void accumulate(float *out, const unsigned char *in, size_t size, float weight) {
+            size_t i=0;
+#ifdef __SSE2__
+            auto weights=_mm_set1_ps(weight);
+            auto zero=_mm_setzero_si128();
+            for(;i+16<=size;i+=16) {
+                auto bytes=_mm_loadu_si128(reinterpret_cast<const __m128i*>(in+i));
+                auto low=_mm_unpacklo_epi8(bytes, zero);
+                auto high=_mm_unpackhi_epi8(bytes, zero);
+                __m128i values[4]={_mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                                   _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+                for(size_t c=0;c<4;c++) {
+                    auto sum=_mm_add_ps(_mm_loadu_ps(out+i+4*c), _mm_mul_ps(weights, _mm_cvtepi32_ps(values[c])));
+                    _mm_storeu_ps(out+i+4*c, sum);
+                }
+            }
+#endif
+            for(;i<size;i++)
+                out[i]+=weight*in[i];
+        }
+
+        static unsigned char to_byte(float value) {
+            return static_cast<unsigned char>(std::min(255.0f, value+0.5f));
+        }
+    };
+}
+#endif	/* THUMBNAILS_HPP */
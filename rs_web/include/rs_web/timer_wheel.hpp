@@ -0,0 +1,141 @@
+#ifndef TIMER_WHEEL_HPP
+#define	TIMER_WHEEL_HPP
+
+#include <cstdint>
+#include <mutex>
+
+namespace SimpleWeb {
+    ///Hierarchical timer wheel in the style of the classic Linux kernel timers: timeouts are arming and disarming
+    ///an intrusive list node in O(1), and advance() is called once per tick. The first level has one slot per tick
+    ///for the next 256 ticks, each further level has 64 slots covering 64 times the range of the level below.
+    ///Nodes of later levels are moved down (cascaded) as their expiry comes closer.
+    class TimerWheel {
+    public:
+        class Node {
+            friend class TimerWheel;
+        public:
+            Node(): previous(nullptr), next(nullptr), expires(0) {}
+
+            bool armed() const {
+                return next!=nullptr;
+            }
+
+        private:
+            Node *previous, *next;
+            uint64_t expires;
+
+            void unlink() {
+                previous->next=next;
+                next->previous=previous;
+                previous=next=nullptr;
+            }
+        };
+
+        TimerWheel(): current(0) {
+            for(auto &slot: first_level)
+                slot.previous=slot.next=&slot;
+            for(auto &level: levels) {
+                for(auto &slot: level)
+                    slot.previous=slot.next=&slot;
+            }
+        }
+
+        TimerWheel(const TimerWheel&)=delete;
+        TimerWheel &operator=(const TimerWheel&)=delete;
+
+        ///Arms node to expire after at least ticks ticks, disarming it first if it is armed
+        void arm(Node &node, uint64_t ticks) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(node.armed())
+                node.unlink();
+            //The slot of tick current is processed by the next advance(), so the node expires after ticks+1 advances:
+            //the current tick has partly passed already
+            node.expires=current+ticks;
+            add(node);
+        }
+
+        void disarm(Node &node) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(node.armed())
+                node.unlink();
+        }
+
+        ///Advances the wheel by one tick and calls expire for every node that expired, while holding the wheel's mutex.
+        ///The nodes are disarmed before expire is called.
+        template<class expire_type>
+        void advance(const expire_type &expire) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto index=current&first_level_mask;
+            //When the first level wraps around, move the next slot of the level above down, and so on
+            for(size_t level=0;index==0 && level<num_levels;level++) {
+                auto level_index=(current>>(first_level_bits+level*level_bits))&level_mask;
+                cascade(levels[level][level_index]);
+                if(level_index!=0)
+                    break;
+            }
+            current++;
+
+            auto &slot=first_level[index];
+            while(slot.next!=&slot) {
+                auto node=slot.next;
+                node->unlink();
+                expire(*node);
+            }
+        }
+
+    private:
+        static const unsigned first_level_bits=8;
+        static const unsigned level_bits=6;
+        static const size_t num_levels=3;
+        static const uint64_t first_level_mask=(1<<first_level_bits)-1;
+        static const uint64_t level_mask=(1<<level_bits)-1;
+
+        Node first_level[1<<first_level_bits];
+        Node levels[num_levels][1<<level_bits];
+        uint64_t current;
+        std::mutex mutex;
+
+        static void push_back(Node &slot, Node &node) {
+            node.previous=slot.previous;
+            node.next=&slot;
+            slot.previous->next=&node;
+            slot.previous=&node;
+        }
+
+        void add(Node &node) {
+            auto ticks=node.expires-current;
+            if(ticks<(1<<first_level_bits)) {
+                push_back(first_level[node.expires&first_level_mask], node);
+                return;
+            }
+            for(size_t level=0;level<num_levels;level++) {
+                auto shift=first_level_bits+level*level_bits;
+                if(ticks<(uint64_t(1)<<(shift+level_bits)) || level+1==num_levels) {
+                    //Timeouts beyond the last level are kept in its last reachable slot and cascaded again later
+                    auto expires=ticks<(uint64_t(1)<<(shift+level_bits))?node.expires:current+(uint64_t(level_mask)<<shift);
+                    push_back(levels[level][(expires>>shift)&level_mask], node);
+                    return;
+                }
+            }
+        }
+
+        void cascade(Node &slot) {
+            Node list;
+            list.previous=list.next=&list;
+            //Move the slot's nodes to a local list first, since add() may put them back into the same slot
+            if(slot.next!=&slot) {
+                list.next=slot.next;
+                list.previous=slot.previous;
+                list.next->previous=&list;
+                list.previous->next=&list;
+                slot.previous=slot.next=&slot;
+            }
+            while(list.next!=&list) {
+                auto node=list.next;
+                node->unlink();
+                add(*node);
+            }
+        }
+    };
+}
+#endif	/* TIMER_WHEEL_HPP */
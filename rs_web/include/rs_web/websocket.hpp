@@ -0,0 +1,360 @@
+#ifndef WEBSOCKET_HPP
+#define	WEBSOCKET_HPP
+
+#include <boost/utility/string_ref.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+namespace SimpleWeb {
+    ///The permessage-deflate extension (RFC 7692). The server compresses every message with a new context
+    ///(server_no_context_takeover), so a compressed frame does not depend on the connection and can be sent to
+    ///several connections. Messages from the client are decompressed with a context kept for the whole connection.
+    class WebSocketDeflate {
+    public:
+        ///Returns the Sec-WebSocket-Extensions value of the response that accepts the first acceptable
+        ///permessage-deflate offer in the extensions of a handshake request, or an empty string if there is none
+        static std::string negotiate(boost::string_ref extensions) {
+            while(!extensions.empty()) {
+                auto end=extensions.find(',');
+                auto offer=extensions.substr(0, end);
+                extensions=end==boost::string_ref::npos?boost::string_ref():extensions.substr(end+1);
+                if(acceptable(offer))
+                    return "permessage-deflate; server_no_context_takeover";
+            }
+            return std::string();
+        }
+
+        ///Compresses a message with raw deflate and removes the final empty block, as required for the payload of a compressed message
+        class Deflater {
+        public:
+            Deflater(int level=Z_DEFAULT_COMPRESSION) {
+                stream.zalloc=Z_NULL;
+                stream.zfree=Z_NULL;
+                stream.opaque=Z_NULL;
+                if(deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK)
+                    throw std::runtime_error("deflateInit2 failed");
+            }
+            ~Deflater() {
+                deflateEnd(&stream);
+            }
+            Deflater(const Deflater&)=delete;
+            Deflater &operator=(const Deflater&)=delete;
+
+            ///Appends the compressed payload to out
+            void compress(boost::string_ref payload, std::string &out) {
+                deflateReset(&stream);
+                stream.next_in=reinterpret_cast<Bytef*>(const_cast<char*>(payload.data()));
+                stream.avail_in=static_cast<uInt>(payload.size());
+                auto begin=out.size();
+                do {
+                    auto size=out.size();
+                    out.resize(size+deflateBound(&stream, stream.avail_in)+16);
+                    stream.next_out=reinterpret_cast<Bytef*>(&out[size]);
+                    stream.avail_out=static_cast<uInt>(out.size()-size);
+                    deflate(&stream, Z_SYNC_FLUSH);
+                    out.resize(out.size()-stream.avail_out);
+                } while(stream.avail_in>0 || stream.avail_out==0);
+                //Z_SYNC_FLUSH ends with 00 00 ff ff, which the receiver appends again
+                if(out.size()-begin>=4)
+                    out.resize(out.size()-4);
+            }
+
+        private:
+            z_stream stream;
+        };
+
+        ///Decompresses the payloads of the compressed messages of one connection
+        class Inflater {
+        public:
+            Inflater(): initialized(false) {}
+            ~Inflater() {
+                if(initialized)
+                    inflateEnd(&stream);
+            }
+            Inflater(const Inflater&)=delete;
+            Inflater &operator=(const Inflater&)=delete;
+
+            ///Replaces message with its decompressed payload. Returns false if message is invalid, or larger than max_size when decompressed.
+            bool decompress(std::string &message, size_t max_size) {
+                if(!initialized) {
+                    stream.zalloc=Z_NULL;
+                    stream.zfree=Z_NULL;
+                    stream.opaque=Z_NULL;
+                    stream.next_in=Z_NULL;
+                    stream.avail_in=0;
+                    if(inflateInit2(&stream, -15)!=Z_OK)
+                        return false;
+                    initialized=true;
+                }
+                message.append("\x00\x00\xff\xff", 4);
+                output.clear();
+                stream.next_in=reinterpret_cast<Bytef*>(&message[0]);
+                stream.avail_in=static_cast<uInt>(message.size());
+                while(stream.avail_in>0) {
+                    auto size=output.size();
+                    output.resize(size+std::max<size_t>(4096, 2*stream.avail_in));
+                    stream.next_out=reinterpret_cast<Bytef*>(&output[size]);
+                    stream.avail_out=static_cast<uInt>(output.size()-size);
+                    auto result=inflate(&stream, Z_SYNC_FLUSH);
+                    output.resize(output.size()-stream.avail_out);
+                    if((result!=Z_OK && result!=Z_BUF_ERROR) || output.size()>max_size)
+                        return false;
+                    if(result==Z_BUF_ERROR && stream.avail_out>0)
+                        break;
+                }
+                message.swap(output);
+                return true;
+            }
+
+        private:
+            z_stream stream;
+            bool initialized;
+            std::string output;
+        };
+
+    private:
+        ///Returns true if offer is permessage-deflate with parameters that a server without context takeover can accept
+        static bool acceptable(boost::string_ref offer) {
+            bool first=true;
+            std::vector<boost::string_ref> names;
+            while(!offer.empty() || first) {
+                auto end=offer.find(';');
+                auto element=trim(offer.substr(0, end));
+                offer=end==boost::string_ref::npos?boost::string_ref():offer.substr(end+1);
+                if(first) {
+                    if(!boost::iequals(element, "permessage-deflate"))
+                        return false;
+                    first=false;
+                    continue;
+                }
+                auto equals=element.find('=');
+                auto name=trim(element.substr(0, equals));
+                auto value=equals==boost::string_ref::npos?boost::string_ref():trim(element.substr(equals+1));
+                if(value.size()>=2 && value.front()=='"' && value.back()=='"')
+                    value=value.substr(1, value.size()-2);
+                for(auto &other: names) {
+                    if(boost::iequals(other, name))
+                        return false;
+                }
+                names.emplace_back(name);
+                if(boost::iequals(name, "server_no_context_takeover") || boost::iequals(name, "client_no_context_takeover")) {
+                    if(!value.empty())
+                        return false;
+                }
+                //The client may use any window size, the receiving context always has the largest window
+                else if(boost::iequals(name, "client_max_window_bits")) {
+                    if(!value.empty() && !window_bits(value))
+                        return false;
+                }
+                //A smaller server window would make compressed frames depend on the connection
+                else if(boost::iequals(name, "server_max_window_bits")) {
+                    if(value!="15")
+                        return false;
+                }
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        static bool window_bits(boost::string_ref value) {
+            return (value.size()==1 && value[0]>='8' && value[0]<='9') || (value.size()==2 && value[0]=='1' && value[1]>='0' && value[1]<='5');
+        }
+
+        static boost::string_ref trim(boost::string_ref value) {
+            while(!value.empty() && (value.front()==' ' || value.front()=='\t'))
+                value.remove_prefix(1);
+            while(!value.empty() && (value.back()==' ' || value.back()=='\t'))
+                value.remove_suffix(1);
+            return value;
+        }
+    };
+
+    ///Frames and handshake of the WebSocket protocol (RFC 6455)
+    class WebSocketProtocol {
+    public:
+        enum Opcode {continuation=0, text=1, binary=2, close=8, ping=9, pong=10};
+
+        ///Header of a received frame
+        class FrameHeader {
+        public:
+            bool fin, rsv1, rsv2, rsv3;
+            unsigned char opcode;
+            bool masked;
+            unsigned char mask[4];
+            uint64_t length;
+            ///Size of the header itself
+            size_t size;
+
+            ///Parses the header at the beginning of the size bytes at data. Returns false if they do not contain the whole header.
+            bool parse(const char *data, size_t size) {
+                if(size<2)
+                    return false;
+                auto bytes=reinterpret_cast<const unsigned char*>(data);
+                fin=(bytes[0]&0x80)!=0;
+                rsv1=(bytes[0]&0x40)!=0;
+                rsv2=(bytes[0]&0x20)!=0;
+                rsv3=(bytes[0]&0x10)!=0;
+                opcode=bytes[0]&0x0f;
+                masked=(bytes[1]&0x80)!=0;
+                length=bytes[1]&0x7f;
+                this->size=2;
+                size_t num_length_bytes=length==126?2:(length==127?8:0);
+                if(size<this->size+num_length_bytes+(masked?4:0))
+                    return false;
+                if(num_length_bytes>0) {
+                    length=0;
+                    for(size_t c=0;c<num_length_bytes;c++)
+                        length=(length<<8)|bytes[this->size+c];
+                    this->size+=num_length_bytes;
+                }
+                if(masked) {
+                    for(size_t c=0;c<4;c++)
+                        mask[c]=bytes[this->size+c];
+                    this->size+=4;
+                }
+                return true;
+            }
+        };
+
+        ///Unmasks the size bytes of a payload at data in place
+        static void unmask(char *data, size_t size, const unsigned char mask[4]) {
+            for(size_t c=0;c<size;c++)
+                data[c]=static_cast<char>(data[c]^mask[c%4]);
+        }
+
+        ///Appends the header of an unmasked frame with a payload of length bytes to frame
+        static void write_header(std::string &frame, unsigned char fin_rsv_opcode, uint64_t length) {
+            frame+=static_cast<char>(fin_rsv_opcode);
+            if(length<126)
+                frame+=static_cast<char>(length);
+            else {
+                size_t num_length_bytes=length<=0xffff?2:8;
+                frame+=static_cast<char>(num_length_bytes==2?126:127);
+                for(size_t c=num_length_bytes;c>0;c--)
+                    frame+=static_cast<char>((length>>(8*(c-1)))&0xff);
+            }
+        }
+
+        ///Returns an unmasked frame with the whole message payload. If compress is set, the payload is compressed for
+        ///permessage-deflate when that makes it smaller. The frame does not depend on the connection it is sent on.
+        static std::string message_frame(unsigned char opcode, boost::string_ref payload, bool compress) {
+            std::string frame;
+            if(compress && payload.size()>=min_compress_size) {
+                static thread_local WebSocketDeflate::Deflater deflater;
+                std::string compressed;
+                deflater.compress(payload, compressed);
+                if(compressed.size()<payload.size()) {
+                    frame.reserve(compressed.size()+10);
+                    write_header(frame, 0x80|0x40|opcode, compressed.size());
+                    frame+=compressed;
+                    return frame;
+                }
+            }
+            frame.reserve(payload.size()+10);
+            write_header(frame, 0x80|opcode, payload.size());
+            frame.append(payload.data(), payload.size());
+            return frame;
+        }
+
+        ///Returns the Sec-WebSocket-Accept value of the response to a handshake with Sec-WebSocket-Key key
+        static std::string accept_key(boost::string_ref key) {
+            std::string input(key.data(), key.size());
+            input+="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+            unsigned char digest[20];
+            sha1(input, digest);
+            return base64(digest, sizeof(digest));
+        }
+
+        static void sha1(const std::string &input, unsigned char digest[20]) {
+            uint32_t h[5]={0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+            //The input is padded with 0x80 and zeros to 56 bytes modulo 64, followed by its length in bits
+            std::string message(input);
+            message+=static_cast<char>(0x80);
+            while(message.size()%64!=56)
+                message+='\0';
+            auto bits=static_cast<uint64_t>(input.size())*8;
+            for(int c=7;c>=0;c--)
+                message+=static_cast<char>((bits>>(8*c))&0xff);
+
+            for(size_t block=0;block<message.size();block+=64) {
+                uint32_t w[80];
+                auto bytes=reinterpret_cast<const unsigned char*>(message.data()+block);
+                for(size_t c=0;c<16;c++)
+                    w[c]=(uint32_t(bytes[4*c])<<24)|(uint32_t(bytes[4*c+1])<<16)|(uint32_t(bytes[4*c+2])<<8)|uint32_t(bytes[4*c+3]);
+                for(size_t c=16;c<80;c++)
+                    w[c]=rotate_left(w[c-3]^w[c-8]^w[c-14]^w[c-16], 1);
+
+                uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+                for(size_t i=0;i<80;i++) {
+                    uint32_t f, k;
+                    if(i<20) {
+                        f=(b&c)|(~b&d);
+                        k=0x5a827999;
+                    }
+                    else if(i<40) {
+                        f=b^c^d;
+                        k=0x6ed9eba1;
+                    }
+                    else if(i<60) {
+                        f=(b&c)|(b&d)|(c&d);
+                        k=0x8f1bbcdc;
+                    }
+                    else {
+                        f=b^c^d;
+                        k=0xca62c1d6;
+                    }
+                    auto temp=rotate_left(a, 5)+f+e+k+w[i];
+                    e=d;
+                    d=c;
+                    c=rotate_left(b, 30);
+                    b=a;
+                    a=temp;
+                }
+                h[0]+=a;
+                h[1]+=b;
+                h[2]+=c;
+                h[3]+=d;
+                h[4]+=e;
+            }
+            for(size_t c=0;c<5;c++) {
+                for(size_t byte=0;byte<4;byte++)
+                    digest[4*c+byte]=static_cast<unsigned char>((h[c]>>(24-8*byte))&0xff);
+            }
+        }
+
+        static std::string base64(const unsigned char *data, size_t size) {
+            static const char alphabet[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string result;
+            result.reserve((size+2)/3*4);
+            for(size_t c=0;c<size;c+=3) {
+                uint32_t group=uint32_t(data[c])<<16;
+                if(c+1<size)
+                    group|=uint32_t(data[c+1])<<8;
+                if(c+2<size)
+                    group|=data[c+2];
+                result+=alphabet[(group>>18)&0x3f];
+                result+=alphabet[(group>>12)&0x3f];
+                result+=c+1<size?alphabet[(group>>6)&0x3f]:'=';
+                result+=c+2<size?alphabet[group&0x3f]:'=';
+            }
+            return result;
+        }
+
+    private:
+        ///Smaller payloads rarely get smaller when compressed
+        static const size_t min_compress_size=64;
+
+        static uint32_t rotate_left(uint32_t value, unsigned bits) {
+            return (value<<bits)|(value>>(32-bits));
+        }
+    };
+
+}
+#endif	/* WEBSOCKET_HPP */
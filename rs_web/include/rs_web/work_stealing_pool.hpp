@@ -0,0 +1,132 @@
+#ifndef WORK_STEALING_POOL_HPP
+#define	WORK_STEALING_POOL_HPP
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace SimpleWeb {
+    ///Runs CPU-bound tasks, such as making thumbnails, on a fixed number of threads. Every thread has its own queue, which
+    ///it runs in order, and threads without tasks take the newest tasks of the other queues, at the other end than their
+    ///owner. Tasks posted by a thread of the pool are added to its own queue, tasks posted from other threads are spread
+    ///over the queues in turn.
+    class WorkStealingPool {
+    public:
+        WorkStealingPool(size_t num_threads): pending(0), stopping(false), next_queue(0) {
+            if(num_threads==0)
+                num_threads=1;
+            for(size_t c=0;c<num_threads;c++)
+                queues.emplace_back(new Queue());
+            for(size_t c=0;c<num_threads;c++)
+                threads.emplace_back([this, c] { run(c); });
+        }
+
+        ///Runs the tasks posted so far, then stops the threads
+        ~WorkStealingPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping=true;
+            }
+            condition.notify_all();
+            for(auto &thread: threads)
+                thread.join();
+        }
+
+        WorkStealingPool(const WorkStealingPool&)=delete;
+        WorkStealingPool &operator=(const WorkStealingPool&)=delete;
+
+        ///Runs task on one of the threads. Tasks must not throw.
+        void post(std::function<void()> task) {
+            auto index=current_pool()==this?current_index():next_queue++%queues.size();
+            {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                queues[index]->tasks.emplace_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending++;
+            }
+            condition.notify_one();
+        }
+
+        size_t size() const {
+            return threads.size();
+        }
+
+    private:
+        class Queue {
+        public:
+            std::mutex mutex;
+            std::deque<std::function<void()> > tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue> > queues;
+        std::vector<std::thread> threads;
+
+        ///Protects pending and stopping, for the threads waiting for tasks
+        std::mutex mutex;
+        std::condition_variable condition;
+        ///Tasks in the queues
+        size_t pending;
+        bool stopping;
+        std::atomic<size_t> next_queue;
+
+        static WorkStealingPool *&current_pool() {
+            static thread_local WorkStealingPool *pool=nullptr;
+            return pool;
+        }
+        static size_t &current_index() {
+            static thread_local size_t index=0;
+            return index;
+        }
+
+        void run(size_t index) {
+            current_pool()=this;
+            current_index()=index;
+            while(true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this] {
+                        return pending>0 || stopping;
+                    });
+                    if(pending==0)
+                        return;
+                    pending--;
+                }
+                //A task has been reserved by decrementing pending, so one of the queues has one
+                std::function<void()> task;
+                while(!take(index, task)) {}
+                task();
+            }
+        }
+
+        ///Takes the oldest task of the own queue, or else the newest task of another queue
+        bool take(size_t index, std::function<void()> &task) {
+            {
+                auto &queue=*queues[index];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if(!queue.tasks.empty()) {
+                    task=std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                    return true;
+                }
+            }
+            for(size_t c=1;c<queues.size();c++) {
+                auto &queue=*queues[(index+c)%queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if(!queue.tasks.empty()) {
+                    task=std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+}
+#endif	/* WORK_STEALING_POOL_HPP */
@@ -0,0 +1,351 @@
+#include <rs_web/client_http.hpp>
+#include <rs_web/json.hpp>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+
+using namespace std;
+
+typedef SimpleWeb::Client<SimpleWeb::HTTP> HttpClient;
+
+//Counts of latencies in microseconds, in buckets as HdrHistogram has them: values below 2048 are counted exactly,
+//larger ones with 1024 buckets per power of two, so that every percentile is accurate to 0.1%
+class LatencyHistogram
+{
+public:
+  LatencyHistogram() : count(0), sum(0), minimum(numeric_limits<uint64_t>::max()), maximum(0) {}
+
+  void record(uint64_t value)
+  {
+    auto bucket = index(value);
+    if(bucket >= counts.size())
+      counts.resize(bucket + 1);
+    counts[bucket]++;
+    count++;
+    sum += value;
+    minimum = min(minimum, value);
+    maximum = max(maximum, value);
+  }
+
+  void add(const LatencyHistogram &histogram)
+  {
+    if(histogram.counts.size() > counts.size())
+      counts.resize(histogram.counts.size());
+    for(size_t c = 0; c < histogram.counts.size(); c++)
+      counts[c] += histogram.counts[c];
+    count += histogram.count;
+    sum += histogram.sum;
+    minimum = min(minimum, histogram.minimum);
+    maximum = max(maximum, histogram.maximum);
+  }
+
+  //The largest value of the bucket that holds the latency not exceeded by percentile percent of the requests
+  uint64_t percentile(double percentile) const
+  {
+    auto rank = static_cast<uint64_t>(ceil(percentile / 100.0 * static_cast<double>(count)));
+    uint64_t counted = 0;
+    for(size_t c = 0; c < counts.size(); c++)
+    {
+      counted += counts[c];
+      if(counted >= max(rank, uint64_t(1)))
+        return min(highest(c), maximum);
+    }
+    return maximum;
+  }
+
+  uint64_t count, sum, minimum, maximum;
+
+private:
+  static const uint64_t exact = 2048, per_power = 1024;
+  vector<uint64_t> counts;
+
+  static size_t index(uint64_t value)
+  {
+    if(value < exact)
+      return static_cast<size_t>(value);
+    int shift = 63 - __builtin_clzll(value) - 10;
+    return static_cast<size_t>(exact + (shift - 1) * per_power + (value >> shift) - per_power);
+  }
+
+  static uint64_t highest(size_t index)
+  {
+    if(index < exact)
+      return index;
+    auto shift = (index - exact) / per_power + 1;
+    auto sub_bucket = (index - exact) % per_power + per_power;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+};
+
+class Options
+{
+public:
+  string host = "localhost:5555";
+  string workload = "static";
+  vector<string> paths;
+  size_t connections = 16;
+  size_t threads = 1;
+  double duration = 10;
+  double warmup = 1;
+  //Requests per second of all connections together, 0 sends every request when the previous one has been answered
+  double rate = 0;
+  bool close = false;
+};
+
+//One connection to the server and the latencies measured on it
+class Connection
+{
+public:
+  Connection(const string &host) : client(host), sent(0), errors(0), failed_responses(0), bytes(0) {}
+
+  HttpClient client;
+  unique_ptr<boost::asio::steady_timer> timer;
+  size_t sent;
+  mutex histogram_mutex;
+  LatencyHistogram histogram;
+  size_t errors, failed_responses, bytes;
+};
+
+void usage()
+{
+  cerr << "Usage: http_bench [--host=localhost:5555] [--workload=static|add_new_query|get_history_query]" << endl
+       << "                  [--path=/index.html]... [--connections=16] [--threads=1] [--duration=10] [--warmup=1]" << endl
+       << "                  [--rate=<requests per second>] [--close]" << endl
+       << endl
+       << "Sends requests to the server on a number of connections for duration seconds, and reports the throughput" << endl
+       << "and the latency percentiles of the requests due after warmup seconds." << endl
+       << "  --workload=static             GET the --path files in turn (default /index.html)" << endl
+       << "  --workload=add_new_query      POST queries to /robosherlock/add_new_query, which appends them to the history" << endl
+       << "  --workload=get_history_query  POST indices to /robosherlock/get_history_query" << endl
+       << "  --connections                 number of connections, which each send one request at a time" << endl
+       << "  --threads                     threads running the connections" << endl
+       << "  --rate                        send requests at fixed times instead of after the previous response, and" << endl
+       << "                                measure latencies from those times, so that a stalled server is not hidden" << endl
+       << "                                by requests that were never sent (coordinated omission)" << endl
+       << "  --close                       ask the server to close the connection after every response" << endl;
+}
+
+bool parse_options(int argc, char *argv[], Options &options)
+{
+  for(int c = 1; c < argc; c++)
+  {
+    string argument = argv[c];
+    auto equal = argument.find('=');
+    auto name = argument.substr(0, equal);
+    auto value = equal != string::npos ? argument.substr(equal + 1) : string();
+    try
+    {
+      if(name == "--host")
+        options.host = value;
+      else if(name == "--workload" && (value == "static" || value == "add_new_query" || value == "get_history_query"))
+        options.workload = value;
+      else if(name == "--path")
+        options.paths.emplace_back(value);
+      else if(name == "--connections")
+        options.connections = max(stoul(value), 1ul);
+      else if(name == "--threads")
+        options.threads = max(stoul(value), 1ul);
+      else if(name == "--duration")
+        options.duration = stod(value);
+      else if(name == "--warmup")
+        options.warmup = stod(value);
+      else if(name == "--rate")
+        options.rate = stod(value);
+      else if(name == "--close" && equal == string::npos)
+        options.close = true;
+      else
+        return false;
+    }
+    catch(const exception &)
+    {
+      return false;
+    }
+  }
+  if(options.paths.empty())
+    options.paths.emplace_back("/index.html");
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  if(!parse_options(argc, argv, options))
+  {
+    usage();
+    return 1;
+  }
+
+  auto io_service = make_shared<boost::asio::io_service>();
+  unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(*io_service));
+
+  map<string, string> header;
+  if(options.close)
+    header["Connection"] = "close";
+  if(options.workload != "static")
+    header["Content-Type"] = "application/json";
+
+  //Request i of the workload, by method, path and content
+  auto make_request = [&options](size_t i, string &method, string &path, string &content)
+  {
+    content.clear();
+    if(options.workload == "static")
+    {
+      method = "GET";
+      path = options.paths[i % options.paths.size()];
+    }
+    else if(options.workload == "add_new_query")
+    {
+      method = "POST";
+      path = "/robosherlock/add_new_query";
+      SimpleWeb::JsonWriter(content).start_object().key("query").string_value("bench_query(" + to_string(i % 1000) + ").").end_object();
+    }
+    else
+    {
+      method = "POST";
+      path = "/robosherlock/get_history_query";
+      SimpleWeb::JsonWriter(content).start_object().key("index").unsigned_value(i % 100).end_object();
+    }
+  };
+
+  vector<unique_ptr<Connection> > connections;
+  for(size_t c = 0; c < options.connections; c++)
+  {
+    connections.emplace_back(new Connection(options.host));
+    auto &client = connections.back()->client;
+    client.io_service = io_service;
+    client.config.max_connections = 1;
+    client.config.timeout = 60;
+  }
+
+  auto start = chrono::steady_clock::now();
+  auto measure_from = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.warmup));
+  auto end = measure_from + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.duration));
+  atomic<size_t> requests(0), running(0);
+
+  //Sends request number i of connection, whose latency counts from scheduled
+  function<void(Connection &, chrono::steady_clock::time_point)> send;
+  //Closed loop: the next request of a connection is sent when the previous one has been answered
+  function<void(Connection &)> send_next = [&](Connection &connection)
+  {
+    if(chrono::steady_clock::now() >= end)
+    {
+      running--;
+      return;
+    }
+    send(connection, chrono::steady_clock::now());
+  };
+  send = [&](Connection &connection, chrono::steady_clock::time_point scheduled)
+  {
+    string method, path, content;
+    make_request(requests++, method, path, content);
+    connection.sent++;
+    connection.client.async_request(method, path, content, header,
+                                    [&, scheduled](const shared_ptr<HttpClient::Response> &response, const boost::system::error_code &ec)
+    {
+      auto now = chrono::steady_clock::now();
+      //Counted by the time the request was due, however late it was answered
+      if(scheduled >= measure_from)
+      {
+        lock_guard<mutex> lock(connection.histogram_mutex);
+        if(ec)
+          connection.errors++;
+        else
+        {
+          if(response->status_code.compare(0, 1, "2") != 0)
+            connection.failed_responses++;
+          connection.bytes += static_cast<size_t>(response->content.rdbuf()->in_avail());
+          connection.histogram.record(static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(now - scheduled).count()));
+        }
+      }
+      if(options.rate <= 0)
+        send_next(connection);
+      else
+        running--;
+    });
+  };
+
+  //Open loop: every connection sends its requests at fixed times, spread evenly between the connections,
+  //whether the previous requests have been answered or not. Requests that can not be sent yet wait for the connection.
+  auto interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.rate > 0 ? options.connections / options.rate : 0));
+  function<void(Connection &, chrono::steady_clock::time_point)> schedule = [&](Connection &connection, chrono::steady_clock::time_point time)
+  {
+    if(time >= end)
+    {
+      running--;
+      return;
+    }
+    connection.timer->expires_at(time);
+    connection.timer->async_wait([&, time](const boost::system::error_code &ec)
+    {
+      if(ec)
+      {
+        running--;
+        return;
+      }
+      running++;
+      send(connection, time);
+      schedule(connection, time + interval);
+    });
+  };
+
+  for(size_t c = 0; c < connections.size(); c++)
+  {
+    auto &connection = *connections[c];
+    running++;
+    if(options.rate > 0)
+    {
+      connection.timer.reset(new boost::asio::steady_timer(*io_service));
+      schedule(connection, start + interval * static_cast<int>(c) / static_cast<int>(connections.size()));
+    }
+    else
+      io_service->post([&send_next, &connection] { send_next(connection); });
+  }
+
+  vector<thread> threads;
+  for(size_t c = 0; c < options.threads; c++)
+    threads.emplace_back([io_service] { io_service->run(); });
+
+  //Waits for the requests sent until the end
+  while(running > 0)
+    this_thread::sleep_for(chrono::milliseconds(10));
+  auto finished = chrono::steady_clock::now();
+  for(auto &connection : connections)
+    connection->client.close();
+  work.reset();
+  for(auto &thread : threads)
+    thread.join();
+
+  LatencyHistogram histogram;
+  size_t errors = 0, failed_responses = 0, bytes = 0, sent = 0;
+  for(auto &connection : connections)
+  {
+    histogram.add(connection->histogram);
+    errors += connection->errors;
+    failed_responses += connection->failed_responses;
+    bytes += connection->bytes;
+    sent += connection->sent;
+  }
+  auto seconds = chrono::duration<double>(finished - measure_from).count();
+  cout << fixed << setprecision(2)
+       << options.workload << " on " << options.connections << " connection" << (options.connections != 1 ? "s" : "")
+       << (options.close ? " closed after every response" : " kept alive") << ", " << options.threads << " thread" << (options.threads != 1 ? "s" : "");
+  if(options.rate > 0)
+    cout << ", " << options.rate << " requests/s scheduled";
+  cout << endl
+       << "Requests: " << histogram.count << " answered in " << seconds << " s, " << histogram.count / seconds << " requests/s, "
+       << bytes / seconds / (1024 * 1024) << " MB/s of content" << endl
+       << "Errors: " << errors << ", responses other than 2xx: " << failed_responses << ", requests sent in all: " << sent << endl;
+  if(histogram.count == 0)
+    return 1;
+  cout << "Latency (us): min " << histogram.minimum << ", mean " << static_cast<double>(histogram.sum) / histogram.count << ", max " << histogram.maximum << endl;
+  for(auto percentile : {50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 100.0})
+    cout << setw(8) << setprecision(percentile < 99.9 ? 0 : (percentile < 99.99 ? 1 : 2)) << percentile << "%  " << histogram.percentile(percentile) << endl;
+  return errors > 0 ? 2 : 0;
+}
@@ -1,75 +1,243 @@
 #include <rs_web/server_http.hpp>
 #include <rs_web/client_http.hpp>
+#include <rs_web/static_files.hpp>
+#include <rs_web/broadcast_hub.hpp>
+#include <rs_web/command_history.hpp>
+#include <rs_web/query_index.hpp>
+#include <rs_web/json.hpp>
+#include <rs_web/result_cache.hpp>
+#include <rs_web/thumbnails.hpp>
+#include <rs_web/work_stealing_pool.hpp>
 
-//Added for the json-example
-#define BOOST_SPIRIT_THREADSAFE
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
-
-//Added for the default_resource example
-#include <fstream>
-#include <boost/filesystem.hpp>
 #include <vector>
+#include <deque>
+#include <tuple>
+#include <fstream>
 #include <algorithm>
+#include <mutex>
 
 #include <ros/package.h>
 
 using namespace std;
-//Added for the json-example:
-using namespace boost::property_tree;
 
 typedef SimpleWeb::Server<SimpleWeb::HTTP> HttpServer;
 typedef SimpleWeb::Client<SimpleWeb::HTTP> HttpClient;
 
-//Added for the default_resource example
-void default_resource_send(const HttpServer &server, const shared_ptr<HttpServer::Response> &response,
-                           const shared_ptr<ifstream> &ifs)
+//Trims query and replaces every run of whitespace outside of quoted atoms and strings by one space,
+//so that queries differing only in their layout share one cache entry
+string normalize_query(const string &query)
+{
+  string normalized;
+  char quote = 0;
+  bool space = false;
+  for(size_t c = 0; c < query.size(); c++)
+  {
+    auto character = query[c];
+    if(quote)
+    {
+      normalized += character;
+      if(character == '\\' && c + 1 < query.size())
+        normalized += query[++c];
+      else if(character == quote)
+        quote = 0;
+      continue;
+    }
+    if(isspace(static_cast<unsigned char>(character)))
+    {
+      space = !normalized.empty();
+      continue;
+    }
+    if(space)
+      normalized += ' ';
+    space = false;
+    //0'c is the character code of c, not a quote
+    if(character == '\'' && !normalized.empty() && normalized.back() == '0' &&
+       (normalized.size() == 1 || !isalnum(static_cast<unsigned char>(normalized[normalized.size() - 2]))))
+    {
+      normalized += character;
+      if(c + 1 < query.size())
+        normalized += query[++c];
+      continue;
+    }
+    if(character == '\'' || character == '"' || character == '`')
+      quote = character;
+    normalized += character;
+  }
+  return normalized;
+}
+
+//The thumbnails of a /thumbnails/batch response, written to it as they are done, but only while its connection
+//is writable, so that the images and their base64 encodings do not pile up in memory for a slow client.
+//The response is released, which ends it, with the last reference to the batch.
+class ThumbnailBatch : public enable_shared_from_this<ThumbnailBatch>
 {
-  //read and send 128 KB at a time
-  static vector<char> buffer(131072); // Safe when server is running on one thread
-  streamsize read_length;
-  if((read_length = ifs->read(&buffer[0], buffer.size()).gcount()) > 0)
+public:
+  ThumbnailBatch(HttpServer &server, const shared_ptr<HttpServer::Response> &response, size_t size, const string &boundary)
+      : server(server), response(response), remaining(size), boundary(boundary), waiting(false) {}
+
+  //Called from the thumbnail pool with a thumbnail of the batch, and nullptr as image if there is none
+  void done(size_t index, const SimpleWeb::Thumbnails::Thumbnail &thumbnail, const shared_ptr<const string> &image)
+  {
+    {
+      lock_guard<mutex> lock(write_mutex);
+      finished.emplace_back(index, thumbnail, image);
+    }
+    write();
+  }
+
+private:
+  HttpServer &server;
+  shared_ptr<HttpServer::Response> response;
+  size_t remaining;
+  //Multipart boundary, or empty for newline-delimited JSON
+  string boundary;
+  //Protects the members below and the writes to response
+  mutex write_mutex;
+  deque<tuple<size_t, SimpleWeb::Thumbnails::Thumbnail, shared_ptr<const string>>> finished;
+  //Set while an on_writable() handler is pending
+  bool waiting;
+
+  void write()
   {
-    response->write(&buffer[0], read_length);
-    if(read_length == static_cast<streamsize>(buffer.size()))
+    unique_lock<mutex> lock(write_mutex);
+    if(waiting)
+      return;
+    while(!finished.empty())
     {
-      server.send(response, [&server, response, ifs](const boost::system::error_code & ec)
+      if(!server.writable(response))
       {
-        if(!ec)
+        waiting = true;
+        lock.unlock();
+        auto batch = shared_from_this();
+        server.on_writable(response, [batch]
         {
-          default_resource_send(server, response, ifs);
-        }
-        else
+          {
+            lock_guard<mutex> lock(batch->write_mutex);
+            batch->waiting = false;
+          }
+          batch->write();
+        });
+        return;
+      }
+      auto index = get<0>(finished.front());
+      auto thumbnail = move(get<1>(finished.front()));
+      auto image = move(get<2>(finished.front()));
+      finished.pop_front();
+      if(!boundary.empty())
+      {
+        *response << "--" << boundary << "\r\nContent-ID: " << index << "\r\nX-Image-Id: " << thumbnail.id << "\r\n";
+        if(image)
         {
-          cerr << "Connection interrupted" << endl;
+          *response << "Content-Type: " << SimpleWeb::Thumbnails::content_type(thumbnail.format) << "\r\n\r\n";
+          response->write_shared(image, image->data(), image->size());
+          *response << "\r\n";
         }
-      });
+        else
+          *response << "Content-Type: text/plain\r\n\r\nNo thumbnail\r\n";
+        if(--remaining == 0)
+          *response << "--" << boundary << "--\r\n";
+      }
+      else
+      {
+        string line;
+        SimpleWeb::JsonWriter writer(line);
+        writer.start_object().key("index").unsigned_value(index).key("id").string_value(thumbnail.id);
+        if(image)
+          writer.key("content_type").string_value(SimpleWeb::Thumbnails::content_type(thumbnail.format))
+                .key("data").string_value(SimpleWeb::WebSocketProtocol::base64(reinterpret_cast<const unsigned char*>(image->data()), image->size()));
+        else
+          writer.key("error").string_value("no thumbnail");
+        writer.end_object();
+        *response << line << "\n";
+      }
+      server.send(response);
     }
   }
-}
+};
 
 int main()
 {
-  vector<std::string> commands_history;
-  //HTTP-server at port 8080 using 1 thread
-  //Unless you do more heavy non-threaded processing in the resources,
-  //1 thread is usually faster than several threads
+  //HTTP-server at port 5555 using one sharded event loop per core:
+  //every loop accepts its own connections, so a connection never moves between threads
   int portNr = 5555;
-  HttpServer server(portNr, 1);
+  HttpServer server(portNr, max(1u, thread::hardware_concurrency()));
+  server.config.sharded = true;
+  server.config.cpu_affinity = true;
+
+  //Dashboards connected to /robosherlock/ws, notified of new queries instead of polling for them.
+  //Every event is serialized and framed once, whatever the number of dashboards.
+  SimpleWeb::BroadcastHub<SimpleWeb::HTTP> dashboards;
+  auto &dashboard_endpoint = server.websocket["^/robosherlock/ws$"];
+  dashboard_endpoint.on_open = [&dashboards](shared_ptr<HttpServer::WebSocket> websocket)
+  {
+    dashboards.subscribe(websocket, SimpleWeb::BroadcastHub<SimpleWeb::HTTP>::keep_all);
+  };
+  dashboard_endpoint.on_close = [&dashboards](shared_ptr<HttpServer::WebSocket> websocket, int /*status*/, const string & /*reason*/)
+  {
+    dashboards.unsubscribe(websocket);
+  };
+
+  //The last queries, kept in $ROS_HOME (~/.ros by default) across restarts of the server
+  string ros_home = getenv("ROS_HOME") ? getenv("ROS_HOME") : string(getenv("HOME") ? getenv("HOME") : ".") + "/.ros";
+  const size_t history_capacity = 10000;
+  unique_ptr<SimpleWeb::CommandHistory> commands_history;
+  try
+  {
+    commands_history.reset(new SimpleWeb::CommandHistory(history_capacity, ros_home + "/rs_web_history.log"));
+  }
+  catch(const exception &e)
+  {
+    cerr << "Query history is not persistent: " << e.what() << endl;
+    commands_history.reset(new SimpleWeb::CommandHistory(history_capacity));
+  }
 
   auto pkg_path = ros::package::getPath("rs_web");
-  server.resource["^/robosherlock/add_new_query$"]["POST"] = [&commands_history](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+
+  //Autocompletion over the query history, most recent first, followed by the example queries. The index keeps as many
+  //distinct queries as the history keeps queries, so it holds at least those in the history.
+  SimpleWeb::QueryIndex query_index(history_capacity);
+  for(size_t index = commands_history->size(); index > 0; index--)
+  {
+    if(auto query = commands_history->get(index - 1))
+      query_index.add(*query);
+  }
+  try
+  {
+    ifstream examples_file(pkg_path + "/html/testQueries.json", ios::binary);
+    if(!examples_file)
+      throw runtime_error("could not open " + pkg_path + "/html/testQueries.json");
+    string examples_text((istreambuf_iterator<char>(examples_file)), istreambuf_iterator<char>());
+    auto examples = SimpleWeb::JsonValue::parse(examples_text);
+    for(auto &example : examples.at("query").items)
+    {
+      auto query = example.find("q");
+      auto text = example.find("text");
+      if(query && !query->as_string().empty())
+        query_index.add_example(query->as_string(), text ? text->as_string() : string());
+    }
+  }
+  catch(const exception &e)
+  {
+    cerr << "Could not load the example queries: " << e.what() << endl;
+  }
+
+  server.resource["^/robosherlock/add_new_query$"]["POST"] = [&commands_history, &query_index, &dashboards](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
   {
     try
     {
-      ptree pt;
-      read_json(request->content, pt);
-      string name = pt.get<string>("query");
-      commands_history.push_back(name);
+      auto json = SimpleWeb::JsonValue::parse(request->content.data());
+      const string &name = json.at("query").as_string();
+      commands_history->append(name);
+      query_index.add(name);
+      string event;
+      SimpleWeb::JsonWriter(event).start_object().key("type").string_value("query").key("query").string_value(name).end_object();
+      dashboards.publish(event);
+      string content;
+      SimpleWeb::JsonWriter(content).string_value(name);
       *response << "HTTP/1.1 200 OK\r\n"
                 << "Content-Type: application/json\r\n"
-                << "Content-Length: " << name.length() << "\r\n\r\n"
-                << name;
+                << "Content-Length: " << content.length() << "\r\n\r\n"
+                << content;
     }
     catch(exception &e)
     {
@@ -81,25 +249,29 @@ int main()
   {
     try
     {
-      ptree pt;
-      read_json(request->content, pt);
-      string index_s = pt.get<string>("index");
-      int index_i = std::stoi(index_s);
-      string command="{\"item\":\"";
-      if (index_i >=0 && index_i < commands_history.size()){
-        command = command + commands_history[commands_history.size() - index_i - 1];
+      //The index is sent as a number, older clients send it as a string
+      auto json = SimpleWeb::JsonValue::parse(request->content.data());
+      int index_i = std::stoi(json.at("index").as_string());
+      //Indices count back from the latest query, larger indices return the oldest query
+      shared_ptr<const string> item;
+      auto size = commands_history->size();
+      long long index = index_i;
+      if (index_i >=0 && static_cast<size_t>(index_i) < size){
+        item = commands_history->get(index_i);
       }else{
-          if (index_i <= -1){
-              index_s = "-1";
+          if (index_i <= -1 || size == 0){
+              index = -1;
           }else{
-              index_s = to_string(commands_history.size() - 1);
-              command = command + commands_history[0];
+              index = static_cast<long long>(size - 1);
+              item = commands_history->get(size - 1);
           }
 
       }
-      command = command + "\",\"index\":" + index_s;
-      command = command + "}";
-      cout << "command= " << command << endl;
+      string command;
+      SimpleWeb::JsonWriter(command).start_object()
+          .key("item").string_value(item ? *item : string())
+          .key("index").integer_value(index)
+          .end_object();
       *response << "HTTP/1.1 200 OK\r\n"
                 << "Content-Type: application/json\r\n"
                 << "Content-Length: " << command.length() << "\r\n\r\n"
@@ -111,22 +283,258 @@ int main()
     }
   };
 
+  //Returns the best matches for the text typed so far: {"text":"scenes(","k":10} answers {"matches":[{"q":...,"text":...}]}
+  server.resource["^/robosherlock/search_queries$"]["POST"] = [&query_index](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+  {
+    try
+    {
+      auto json = SimpleWeb::JsonValue::parse(request->content.data());
+      auto &text = json.at("text").as_string();
+      auto k_value = json.find("k");
+      auto k = static_cast<size_t>(min(max(k_value ? k_value->as_number() : 10.0, 0.0), 100.0));
+      string content;
+      SimpleWeb::JsonWriter writer(content);
+      writer.start_object().key("matches").start_array();
+      for(auto &match : query_index.search(text, k))
+        writer.start_object().key("q").string_value(match.query).key("text").string_value(match.description).end_object();
+      writer.end_array().end_object();
+      *response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
+    }
+    catch(exception &e)
+    {
+      *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: " << strlen(e.what()) << "\r\n\r\n" << e.what();
+    }
+  };
+
+  //Results of /prolog_query, which are computed by the query backend (html/app.py, or host:port in $RS_PROLOG_BACKEND).
+  //The frontend sends the same example queries over and over, so the responses are cached by normalized query for
+  //ten minutes, and identical queries sent while one is computed wait for its result instead of reaching the backend.
+  //All queries share one asynchronous client, which runs on prolog_thread and keeps up to four connections to the backend
+  //open between queries. Further queries wait for one of them. The responses are completed on prolog_thread and handed
+  //to the loops of their connections.
+  string prolog_backend = getenv("RS_PROLOG_BACKEND") ? getenv("RS_PROLOG_BACKEND") : "localhost:5000";
+  SimpleWeb::ResultCache prolog_cache(1000, 64 * 1024 * 1024, chrono::minutes(10));
+  auto prolog_service = make_shared<boost::asio::io_service>();
+  unique_ptr<boost::asio::io_service::work> prolog_work(new boost::asio::io_service::work(*prolog_service));
+  HttpClient prolog_client(prolog_backend);
+  prolog_client.io_service = prolog_service;
+  prolog_client.config.timeout = 60;
+  prolog_client.config.max_connections = 4;
+  thread prolog_thread([prolog_service] { prolog_service->run(); });
+
+  server.resource["^/prolog_query$"]["POST"] = [&prolog_cache, &prolog_client](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+  {
+    auto query = normalize_query(request->content.string());
+    auto load = [&prolog_client, query](const SimpleWeb::ResultCache::Callback &done)
+    {
+      prolog_client.async_request("POST", "/prolog_query", query, map<string, string>(),
+                                  [query, done](const shared_ptr<HttpClient::Response> &backend_response, const boost::system::error_code &ec)
+      {
+        shared_ptr<string> result;
+        if(ec)
+          cerr << "Query backend failed on " << query << ": " << ec.message() << endl;
+        else if(backend_response->status_code.compare(0, 3, "200") == 0)
+        {
+          stringstream content_stream;
+          content_stream << backend_response->content.rdbuf();
+          auto content = content_stream.str();
+          auto content_type = backend_response->header.find("Content-Type");
+          result = make_shared<string>("HTTP/1.1 200 OK\r\nContent-Type: ");
+          *result += content_type != backend_response->header.end() ? content_type->second : "text/html";
+          *result += "\r\nContent-Length: " + to_string(content.size()) + "\r\n\r\n" + content;
+        }
+        else
+          cerr << "Query backend answered " << backend_response->status_code << " to " << query << endl;
+        done(result);
+      });
+    };
+    //Hits are sent from the cached response without copying it
+    prolog_cache.get(query, load, [response](const shared_ptr<const string> &result)
+    {
+      if(result)
+        response->write_shared(result, result->data(), result->size());
+      else
+        *response << "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+    });
+  };
+
+  //Called when new scenes have been logged, so that the next queries see them
+  server.resource["^/robosherlock/invalidate_query_cache$"]["POST"] = [&prolog_cache](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> /*request*/)
+  {
+    prolog_cache.clear();
+    *response << "HTTP/1.1 204 No Content\r\n\r\n";
+  };
+
+  //Thumbnails of the logged images, instead of scaling and base64-encoding them in Python on every page view:
+  //GET /thumbnails/<image id>[/<x>,<y>,<width>,<height>]/<max width>x<max height>.(jpg|webp)
+  //crops the region, if given, and scales it down to fit into the size. Images are read from binary PPM files named
+  //<image id>.ppm in $RS_IMAGE_STORE, or $ROS_HOME/rs_web_images by default.
+  string image_store = getenv("RS_IMAGE_STORE") ? getenv("RS_IMAGE_STORE") : ros_home + "/rs_web_images";
+  //Thumbnails are made on a pool of their own, so that the event loops keep serving other requests meanwhile
+  SimpleWeb::Thumbnails thumbnails(make_shared<SimpleWeb::FileImageStore>(image_store));
+  SimpleWeb::WorkStealingPool thumbnail_pool(max(1u, thread::hardware_concurrency()));
+  server.resource["^/thumbnails/([A-Za-z0-9_-]+)/(?:([0-9]+),([0-9]+),([0-9]+),([0-9]+)/)?([0-9]+)x([0-9]+)\\.(jpg|webp)$"]["GET"] = [&thumbnails, &thumbnail_pool](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+  {
+    try
+    {
+      auto &match = request->path_match;
+      SimpleWeb::Thumbnails::Thumbnail thumbnail{match[1], 0, 0, 0, 0, stoul(match[6]), stoul(match[7]),
+                                                 match[8] == "webp" ? SimpleWeb::Thumbnails::webp : SimpleWeb::Thumbnails::jpeg};
+      if(match[2].matched)
+      {
+        thumbnail.x = stoul(match[2]);
+        thumbnail.y = stoul(match[3]);
+        thumbnail.width = stoul(match[4]);
+        thumbnail.height = stoul(match[5]);
+      }
+      thumbnails.validate(thumbnail);
+      thumbnail_pool.post([&thumbnails, response, thumbnail]
+      {
+        thumbnails.get(thumbnail, [response, thumbnail](const shared_ptr<const string> &image)
+        {
+          if(!image)
+          {
+            string content = "No thumbnail of " + thumbnail.id;
+            *response << "HTTP/1.1 404 Not Found\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
+            return;
+          }
+          //Logged images do not change, so browsers keep thumbnails for a day
+          *response << "HTTP/1.1 200 OK\r\nContent-Type: " << SimpleWeb::Thumbnails::content_type(thumbnail.format)
+                    << "\r\nCache-Control: max-age=86400\r\nContent-Length: " << image->size() << "\r\n\r\n";
+          response->write_shared(image, image->data(), image->size());
+        });
+      });
+    }
+    catch(const exception &e)
+    {
+      *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: " << strlen(e.what()) << "\r\n\r\n" << e.what();
+    }
+  };
+
+  //Thumbnails of a whole scene grid at once, instead of one request per image:
+  //POST /thumbnails/batch {"size":[150,100],"format":"jpg","thumbnails":[{"id":...,"roi":[x,y,width,height],"size":[w,h]},...]}
+  //where roi and size are optional. The thumbnails are made in parallel and sent as they are done, so pages render
+  //progressively: as newline-delimited JSON {"index":...,"id":...,"content_type":...,"data":<base64>} (or "error" instead
+  //of content_type and data), or as the parts of a multipart/mixed response if the request accepts multipart/mixed.
+  server.resource["^/thumbnails/batch$"]["POST"] = [&server, &thumbnails, &thumbnail_pool](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+  {
+    static const size_t max_batch_size = 1000;
+    static const string boundary = "rs_web_thumbnail_7f3c9a1e5b";
+    vector<SimpleWeb::Thumbnails::Thumbnail> batch;
+    try
+    {
+      auto json = SimpleWeb::JsonValue::parse(request->content.data());
+      auto to_size = [](const SimpleWeb::JsonValue &value)
+      {
+        auto number = value.as_number();
+        if(number < 0 || number > 1e9 || number != floor(number))
+          throw invalid_argument("invalid number " + value.text);
+        return static_cast<size_t>(number);
+      };
+      auto read_size = [&to_size](const SimpleWeb::JsonValue *size, size_t &width, size_t &height)
+      {
+        if(size)
+        {
+          if(size->items.size() != 2)
+            throw invalid_argument("size must be [width,height]");
+          width = to_size(size->items[0]);
+          height = to_size(size->items[1]);
+        }
+      };
+      size_t max_width = 150, max_height = 100;
+      read_size(json.find("size"), max_width, max_height);
+      auto format = json.find("format");
+      auto &items = json.at("thumbnails").items;
+      if(items.size() > max_batch_size)
+        throw invalid_argument("at most " + to_string(max_batch_size) + " thumbnails per batch");
+      for(auto &item : items)
+      {
+        SimpleWeb::Thumbnails::Thumbnail thumbnail{item.at("id").as_string(), 0, 0, 0, 0, max_width, max_height,
+                                                   format && format->as_string() == "webp" ? SimpleWeb::Thumbnails::webp : SimpleWeb::Thumbnails::jpeg};
+        if(auto roi = item.find("roi"))
+        {
+          if(roi->items.size() != 4)
+            throw invalid_argument("roi must be [x,y,width,height]");
+          thumbnail.x = to_size(roi->items[0]);
+          thumbnail.y = to_size(roi->items[1]);
+          thumbnail.width = to_size(roi->items[2]);
+          thumbnail.height = to_size(roi->items[3]);
+        }
+        read_size(item.find("size"), thumbnail.max_width, thumbnail.max_height);
+        thumbnails.validate(thumbnail);
+        batch.emplace_back(move(thumbnail));
+      }
+    }
+    catch(const exception &e)
+    {
+      *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: " << strlen(e.what()) << "\r\n\r\n" << e.what();
+      return;
+    }
+
+    auto accept = request->header.find("Accept");
+    bool multipart = accept != request->header.end() && accept->second.find("multipart/mixed") != string::npos;
+    *response << "HTTP/1.1 200 OK\r\nContent-Type: " << (multipart ? "multipart/mixed; boundary=" + boundary : "application/x-ndjson") << "\r\n";
+    response->chunked();
+    if(batch.empty())
+    {
+      if(multipart)
+        *response << "--" << boundary << "--\r\n";
+      return;
+    }
+    //The header is sent right away, and every thumbnail as soon as it is done and the connection is writable
+    server.send(response);
+    auto output = make_shared<ThumbnailBatch>(server, response, batch.size(), multipart ? boundary : string());
+    for(size_t index = 0; index < batch.size(); index++)
+    {
+      auto done = [output, index](const SimpleWeb::Thumbnails::Thumbnail &thumbnail, const shared_ptr<const string> &image)
+      {
+        output->done(index, thumbnail, image);
+      };
+      auto &thumbnail = batch[index];
+      thumbnail_pool.post([&thumbnails, thumbnail, done]
+      {
+        thumbnails.get(thumbnail, [thumbnail, done](const shared_ptr<const string> &image)
+        {
+          done(thumbnail, image);
+        });
+      });
+    }
+  };
+
   //GET-example for the path /info
-  //Responds with request-information
+  //Responds with request-information, sent chunked instead of computing the Content-Length first
   server.resource["^/info$"]["GET"] = [](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
   {
-    stringstream content_stream;
-    content_stream << "<h1>Request from " << request->remote_endpoint_address << " (" << request->remote_endpoint_port << ")</h1>";
-    content_stream << request->method << " " << request->path << " HTTP/" << request->http_version << "<br>";
+    *response << "HTTP/1.1 200 OK\r\n";
+    response->chunked();
+    *response << "<h1>Request from " << request->remote_endpoint_address << " (" << request->remote_endpoint_port << ")</h1>";
+    *response << request->method << " " << request->path << " HTTP/" << request->http_version << "<br>";
     for(auto & header : request->header)
     {
-      content_stream << header.first << ": " << header.second << "<br>";
+      *response << header.first << ": " << header.second << "<br>";
     }
+  };
 
-    //find length of content_stream (length received using content_stream.tellp())
+  //Server counters: with keep-alive clients the allocation counters stop growing while requests keeps counting
+  server.resource["^/statistics$"]["GET"] = [&server, &prolog_cache](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> /*request*/)
+  {
+    auto statistics = server.statistics();
+    auto cache_statistics = prolog_cache.statistics();
+    stringstream content_stream;
+    content_stream << "{\"connections\":" << statistics.connections
+                   << ",\"requests\":" << statistics.requests
+                   << ",\"requests_allocated\":" << statistics.requests_allocated
+                   << ",\"responses_allocated\":" << statistics.responses_allocated
+                   << ",\"blocks_allocated\":" << statistics.blocks_allocated
+                   << ",\"query_cache\":{\"hits\":" << cache_statistics.hits
+                   << ",\"misses\":" << cache_statistics.misses
+                   << ",\"coalesced\":" << cache_statistics.coalesced
+                   << ",\"evictions\":" << cache_statistics.evictions
+                   << ",\"entries\":" << cache_statistics.entries
+                   << ",\"bytes\":" << cache_statistics.bytes << "}}";
     content_stream.seekp(0, ios::end);
 
-    *response <<  "HTTP/1.1 200 OK\r\nContent-Length: " << content_stream.tellp() << "\r\n\r\n" << content_stream.rdbuf();
+    *response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << content_stream.tellp() << "\r\n\r\n" << content_stream.rdbuf();
   };
 
   //GET-example for the path /match/[number], responds with the matched string in path (number)
@@ -141,48 +549,20 @@ int main()
   //Will respond with content in the web/-directory, and its subdirectories.
   //Default file: index.html
   //Can for instance be used to retrieve an HTML 5 client that uses REST-resources on this server
-  server.default_resource["GET"] = [&server,pkg_path](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
+  //Files are memory-mapped once and served from the cache, large files are sent with sendfile(2)
+  //Validators (ETag, Last-Modified) are always sent, so reloads of the UI are answered with 304 Not Modified
+  SimpleWeb::StaticFiles static_files(pkg_path + "/html");
+  static_files.config.max_age["/static/"] = 3600;
+  static_files.config.max_age["/lib/"] = 3600;
+  server.default_resource["GET"] = [&static_files](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request)
   {
     try
     {
-      auto web_root_path = boost::filesystem::canonical(pkg_path+"/html");
-      auto path = boost::filesystem::canonical(web_root_path / request->path);
-      //Check if path is within web_root_path
-      if(distance(web_root_path.begin(), web_root_path.end()) > distance(path.begin(), path.end()) ||
-         !equal(web_root_path.begin(), web_root_path.end(), path.begin()))
-      {
-        throw invalid_argument("path must be within root path");
-      }
-      if(boost::filesystem::is_directory(path))
-      {
-        path /= "index.html";
-      }
-      if(!(boost::filesystem::exists(path) && boost::filesystem::is_regular_file(path)))
-      {
-        throw invalid_argument("file does not exist");
-      }
-
-      auto ifs = make_shared<ifstream>();
-      ifs->open(path.string(), ifstream::in | ios::binary);
-
-      if(*ifs)
-      {
-        ifs->seekg(0, ios::end);
-        auto length = ifs->tellg();
-
-        ifs->seekg(0, ios::beg);
-
-        *response << "HTTP/1.1 200 OK\r\nContent-Length: " << length << "\r\n\r\n";
-        default_resource_send(server, response, ifs);
-      }
-      else
-      {
-        throw invalid_argument("could not read file");
-      }
+      static_files.serve(response, request);
     }
     catch(const exception &e)
     {
-      string content = "Could not open path " + request->path + ": " + e.what();
+      string content = "Could not open path " + request->path.to_string() + ": " + e.what();
       *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
     }
   };
@@ -193,5 +573,8 @@ int main()
   });
   this_thread::sleep_for(chrono::seconds(1));
   server_thread.join();
+  prolog_work.reset();
+  prolog_client.close();
+  prolog_thread.join();
   return 0;
 }